@@ -0,0 +1,333 @@
+/*
+ * MININ-CHAT TRACE REPLAY v1.0
+ * ============================
+ * Sends a request trace captured with MININ_TRACE=file back to a
+ * local server, either at the original pacing or as fast as
+ * possible, then reports per-endpoint latency and the server's
+ * final-state checksum (/api/state) for comparison with the
+ * original run. Replay into a freshly started server with
+ * MININ_REPLAY=1, so users time out only where the trace says so.
+ *
+ * Usage: replay [-f] [-h HOST] [-p PORT] [-u SOCKET] TRACE
+ *   -f   as fast as possible (default: original pacing)
+ *   -u   connect to a Unix-socket listener instead of HOST:PORT
+ *
+ * Build: gcc -O2 -o replay replay.c -lm
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+
+#include "trace.h"
+
+/* ============================================================
+ * CONFIGURATION
+ * ============================================================ */
+#define MAX_EP      64
+#define EP_SZ       64
+#define RESP_SZ     (1 << 18)
+#define MAX_BODY    (1 << 20)
+
+/* ============================================================
+ * DATA STRUCTURES
+ * ============================================================ */
+typedef struct {
+    char    key[EP_SZ];        /* "METHOD /path" */
+    double *lat;               /* milliseconds */
+    int     n, cap;
+} Endpoint;
+
+typedef struct {
+    char old[TRACE_TK_SZ + 1];
+    char cur[TRACE_TK_SZ + 1];
+} TokMap;
+
+static Endpoint g_ep[MAX_EP];
+static int      g_nep = 0;
+static TokMap  *g_tok = NULL;
+static size_t   g_tcap = 0, g_tcnt = 0;
+static char     g_resp[RESP_SZ];
+
+static const char *g_host = "127.0.0.1";
+static const char *g_port = "3000";
+static const char *g_unix = NULL;
+
+/* ============================================================
+ * UTILITY FUNCTIONS
+ * ============================================================ */
+static uint64_t mono_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static void record_latency(const char *method, const char *target, double ms) {
+    char key[EP_SZ];
+    int kl = snprintf(key, sizeof(key), "%s %s", method, target);
+    char *q = strchr(key, '?');
+    if (q) *q = '\0';
+    else if (kl >= EP_SZ) key[EP_SZ - 1] = '\0';
+
+    Endpoint *e = NULL;
+    for (int i = 0; i < g_nep; i++)
+        if (strcmp(g_ep[i].key, key) == 0) { e = &g_ep[i]; break; }
+    if (!e) {
+        if (g_nep >= MAX_EP) return;
+        e = &g_ep[g_nep++];
+        strcpy(e->key, key);
+    }
+    if (e->n == e->cap) {
+        e->cap = e->cap ? e->cap * 2 : 256;
+        e->lat = realloc(e->lat, sizeof(double) * e->cap);
+        if (!e->lat) { perror("realloc"); exit(1); }
+    }
+    e->lat[e->n++] = ms;
+}
+
+/* ============================================================
+ * TOKEN MAP (trace token -> token issued during replay)
+ * ============================================================ */
+static size_t tok_hash(const char *t) {
+    size_t h = 2166136261u;
+    for (int i = 0; i < TRACE_TK_SZ; i++) h = (h ^ (unsigned char)t[i]) * 16777619u;
+    return h;
+}
+
+static TokMap *tok_slot(TokMap *tab, size_t cap, const char *old) {
+    size_t i = tok_hash(old) & (cap - 1);
+    while (tab[i].old[0] && memcmp(tab[i].old, old, TRACE_TK_SZ) != 0)
+        i = (i + 1) & (cap - 1);
+    return &tab[i];
+}
+
+static void tok_put(const char *old, const char *cur) {
+    if (2 * (g_tcnt + 1) > g_tcap) {
+        size_t ncap = g_tcap ? g_tcap * 2 : 1024;
+        TokMap *nt = calloc(ncap, sizeof(TokMap));
+        if (!nt) { perror("calloc"); exit(1); }
+        for (size_t i = 0; i < g_tcap; i++)
+            if (g_tok[i].old[0]) *tok_slot(nt, ncap, g_tok[i].old) = g_tok[i];
+        free(g_tok);
+        g_tok = nt;
+        g_tcap = ncap;
+    }
+    TokMap *s = tok_slot(g_tok, g_tcap, old);
+    if (!s->old[0]) g_tcnt++;
+    memcpy(s->old, old, TRACE_TK_SZ);
+    memcpy(s->cur, cur, TRACE_TK_SZ);
+}
+
+/* Rewrite every t=TOKEN parameter in place (tokens are fixed-size) */
+static void tok_rewrite(char *s) {
+    if (!g_tcap) return;
+    for (char *p = s; (p = strstr(p, "t=")) != NULL; p += 2) {
+        if (p != s && p[-1] != '&' && p[-1] != '?') continue;
+        char *t = p + 2;
+        int i = 0;
+        while (i < TRACE_TK_SZ && isxdigit((unsigned char)t[i])) i++;
+        if (i < TRACE_TK_SZ) continue;
+        TokMap *m = tok_slot(g_tok, g_tcap, t);
+        if (m->old[0]) memcpy(t, m->cur, TRACE_TK_SZ);
+    }
+}
+
+/* ============================================================
+ * HTTP CLIENT (one connection per request, like the browser)
+ * ============================================================ */
+static int dial(void) {
+    if (g_unix) {
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", g_unix);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(g_host, g_port, &hints, &res) != 0) return -1;
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/* Send one request, read the whole response; returns its length or -1 */
+static int http_call(const char *method, const char *target,
+                     const char *body, int body_len) {
+    int fd = dial();
+    if (fd < 0) return -1;
+
+    static char req[MAX_BODY + 1024];
+    int n = snprintf(req, sizeof(req),
+        "%s %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Content-Type: application/x-www-form-urlencoded\r\n"
+        "Content-Length: %d\r\n"
+        "Connection: close\r\n"
+        "\r\n", method, target, g_host, body_len);
+    memcpy(req + n, body, body_len);
+    n += body_len;
+
+    for (int off = 0; off < n; ) {
+        ssize_t w = write(fd, req + off, n - off);
+        if (w <= 0) { close(fd); return -1; }
+        off += (int)w;
+    }
+
+    int total = 0;
+    for (;;) {
+        ssize_t r = read(fd, g_resp + total, RESP_SZ - 1 - total);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        total += (int)r;
+        if (total >= RESP_SZ - 1) break;
+    }
+    g_resp[total] = '\0';
+    close(fd);
+    return total;
+}
+
+/* ============================================================
+ * REPORT
+ * ============================================================ */
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double pct(const Endpoint *e, double q) {
+    int i = (int)ceil(q * e->n) - 1;
+    if (i < 0) i = 0;
+    if (i >= e->n) i = e->n - 1;
+    return e->lat[i];
+}
+
+static void report(void) {
+    printf("%-28s %7s %9s %9s %9s %9s %9s\n",
+           "ENDPOINT", "COUNT", "mean", "p50", "p90", "p99", "max");
+    for (int i = 0; i < g_nep; i++) {
+        Endpoint *e = &g_ep[i];
+        qsort(e->lat, e->n, sizeof(double), cmp_double);
+        double sum = 0;
+        for (int k = 0; k < e->n; k++) sum += e->lat[k];
+        printf("%-28s %7d %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+               e->key, e->n, sum / e->n, pct(e, 0.5), pct(e, 0.9),
+               pct(e, 0.99), e->lat[e->n - 1]);
+    }
+    printf("(latencies in ms)\n");
+}
+
+/* ============================================================
+ * MAIN
+ * ============================================================ */
+int main(int argc, char **argv) {
+    int fast = 0, opt;
+    while ((opt = getopt(argc, argv, "fh:p:u:")) != -1) {
+        switch (opt) {
+            case 'f': fast = 1; break;
+            case 'h': g_host = optarg; break;
+            case 'p': g_port = optarg; break;
+            case 'u': g_unix = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-f] [-h HOST] [-p PORT] [-u SOCKET] TRACE\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-f] [-h HOST] [-p PORT] [-u SOCKET] TRACE\n", argv[0]);
+        return 2;
+    }
+
+    FILE *f = fopen(argv[optind], "rb");
+    if (!f) { perror(argv[optind]); return 1; }
+
+    TraceFileHdr fh;
+    if (fread(&fh, sizeof(fh), 1, f) != 1 || fh.magic != TRACE_MAGIC ||
+        fh.version != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a minin-chat trace\n", argv[optind]);
+        return 1;
+    }
+
+    static char method[65536], target[65536], body[MAX_BODY + 1];
+    uint64_t t_first = 0, start = mono_us();
+    int sent = 0, skipped = 0, failed = 0;
+    TraceRecHdr h;
+
+    while (fread(&h, sizeof(h), 1, f) == 1) {
+        if (h.body_len > MAX_BODY ||
+            fread(method, 1, h.method_len, f) != h.method_len ||
+            fread(target, 1, h.target_len, f) != h.target_len ||
+            fread(body, 1, h.body_len, f) != h.body_len) {
+            fprintf(stderr, "warning: truncated record, stopping\n");
+            break;
+        }
+        method[h.method_len] = target[h.target_len] = body[h.body_len] = '\0';
+
+        /* The upgrade itself is skipped; its frames were traced as HTTP */
+        if (strncmp(target, "/ws", 3) == 0) { skipped++; continue; }
+
+        if (!sent) t_first = h.t_us;
+        if (!fast) {
+            uint64_t due = start + (h.t_us - t_first), now = mono_us();
+            if (due > now) usleep((useconds_t)(due - now));
+        }
+
+        tok_rewrite(target);
+        tok_rewrite(body);
+
+        uint64_t t0 = mono_us();
+        int n = http_call(method, target, body, (int)h.body_len);
+        double ms = (mono_us() - t0) / 1000.0;
+        sent++;
+        if (n <= 0) { failed++; continue; }
+        record_latency(method, target, ms);
+
+        /* Map the trace's login token to the one issued now */
+        if (h.token[0]) {
+            char *t = strstr(g_resp, "\"t\":\"");
+            if (t && strlen(t + 5) >= TRACE_TK_SZ) tok_put(h.token, t + 5);
+        }
+    }
+    fclose(f);
+
+    double secs = (mono_us() - start) / 1e6;
+    printf("=== REPLAY: %d requests in %.3f s (%.0f req/s, %s) ===\n",
+           sent, secs, secs > 0 ? sent / secs : 0.0,
+           fast ? "as fast as possible" : "original pacing");
+    if (skipped || failed)
+        printf("skipped %d WebSocket upgrades, %d requests failed\n",
+               skipped, failed);
+    report();
+
+    printf("=== FINAL STATE ===\n");
+    if (http_call("GET", "/api/state", "", 0) > 0) {
+        char *b = strstr(g_resp, "\r\n\r\n");
+        printf("%s\n", b ? b + 4 : g_resp);
+    } else {
+        printf("unavailable\n");
+    }
+    return failed ? 1 : 0;
+}
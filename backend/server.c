@@ -1,13 +1,19 @@
 /*
  * MININ-CHAT HTTP SERVER v1.0
  * ===========================
- * Minimal single-threaded HTTP server in C.
+ * Minimal single-threaded HTTP server in C (plus a log writer thread).
  * - Serves static frontend (index.html)
  * - REST API for chat operations
+ * - WebSocket endpoint (/ws) with server push
+ * - Compressed on-disk history segments with backfill
+ * - Async logger thread; the request path never blocks on stdout
+ * - Hot restart on SIGUSR2 without dropping users or connections
+ * - Optional request trace capture for ./replay (MININ_TRACE)
+ * - TCP and Unix-socket listeners, PROXY protocol v1/v2 (MININ_LISTEN)
  * - Calls Fortran for message encryption/decryption
  * - Calls COBOL for message formatting via fork/pipe
  *
- * Build: gcc -O2 -o server server.c encrypt.o -lgfortran -lm
+ * Build: gcc -O2 -pthread -o server server.c encrypt.o -lgfortran -lm -lz
  */
 
 #define _GNU_SOURCE
@@ -18,12 +24,27 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
 #include <time.h>
 #include <ctype.h>
 #include <signal.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <limits.h>
+
+#include "trace.h"
 
 /* ============================================================
  * FORTRAN ENCRYPTION INTERFACE (from encrypt.f90)
@@ -36,10 +57,16 @@ extern void minin_decrypt(const char *in, char *out,
 /* ============================================================
  * CONFIGURATION
  * ============================================================ */
-#define PORT        3000
+#define PORT        3000            /* defaults; see MININ_LISTEN etc. */
 #define BACKLOG     32
 #define BUF_SZ      16384
-#define MAX_MSG     500
+#define MAX_LISTEN  8
+#define UNIX_MODE   0660            /* unix: listener permissions */
+#define MAX_MSG     500             /* hot window; older goes to disk */
+#define SEG_MSGS    (MAX_MSG / 4)   /* messages per history segment */
+#define SEG_RAW_MAX (SEG_MSGS * (13 + 2 * NK_SZ + RM_SZ + MSG_SZ))
+#define HIST_DIR    "/tmp/minin-hist"    /* default; MININ_HIST_DIR */
+#define HIST_SCAN   8               /* segments read per backfill page */
 #define MAX_USR     64
 #define MSG_SZ      480
 #define NK_SZ       24
@@ -50,6 +77,18 @@ extern void minin_decrypt(const char *in, char *out,
 #define HTML_FILE   "/app/static/index.html"
 #define TIMEOUT_SEC 120
 #define POLL_LIMIT  50
+#define ROOM_HASH   128             /* power of two, >= 2 * MAX_USR */
+#define PRES_LOG    256             /* presence changes kept for deltas */
+#define LOG_RING    4096            /* log records, power of two */
+#define LOG_BATCH_SZ 65536          /* bytes written per flush */
+#define LOG_FLUSH_MS 20
+#define MAX_WS      64
+#define WS_BUF_SZ   4096
+#define WS_MSG_SZ   2048
+#define WS_OUT_SZ   65536           /* queued output before a client is dropped */
+#define WS_PING_SEC 30
+#define WS_CLOSE_SEC 5              /* max wait to flush before a close */
+#define WS_GUID     "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
 
 /* ============================================================
  * DATA STRUCTURES
@@ -71,6 +110,8 @@ typedef struct {
     char   token[TK_SZ + 1];
     time_t last_seen;
     int    active;
+    int    rid;            /* g_rooms slot, -1 = none */
+    int    rprev, rnext;   /* room member list links */
 } Usr;
 
 /* ============================================================
@@ -84,6 +125,199 @@ static int  g_next_id = 1;
 static char g_html[262144];
 static int  g_html_len = 0;
 
+/* ============================================================
+ * LOGGING (async, off the request path)
+ * ============================================================
+ * The event loop never touches stdout. It copies a fixed 128-byte
+ * binary record into a single-producer/single-consumer lock-free
+ * ring; a background thread formats records and writes them out in
+ * batches. A full ring drops the record and counts it instead of
+ * blocking. Only the main thread may log.
+ *
+ *   MININ_LOG_LEVEL=debug|info|warn|error   (default info)
+ *   MININ_ACCESS_LOG=1                      per-request access log
+ */
+enum { LV_DEBUG, LV_INFO, LV_WARN, LV_ERROR };
+enum { EV_TEXT, EV_JOIN, EV_TIMEOUT, EV_ACCESS };
+
+typedef struct {
+    uint64_t ts_us;        /* wall clock, microseconds */
+    uint8_t  level;
+    uint8_t  ev;
+    uint16_t status;       /* EV_ACCESS: HTTP status */
+    uint32_t dur_us;       /* EV_ACCESS: time to handle */
+    int32_t  a;            /* EV_ACCESS: response bytes */
+    char     s1[40];       /* tag / nick / client address */
+    char     s2[68];       /* text / token / method + path */
+} LogRec;
+
+_Static_assert(sizeof(LogRec) == 128, "LogRec must stay 128 bytes");
+
+static LogRec           g_log_ring[LOG_RING];
+static _Atomic uint32_t g_log_head = 0;    /* written by main thread */
+static _Atomic uint32_t g_log_tail = 0;    /* written by log thread */
+static _Atomic uint64_t g_log_dropped = 0;
+static _Atomic uint64_t g_log_written = 0;
+static _Atomic int      g_log_stop = 0;
+static int              g_log_level = LV_INFO;
+static int              g_access_log = 0;
+static pthread_t        g_log_thread;
+static int              g_log_running = 0;
+
+static uint64_t now_us(int clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static void copy_field(char *dst, const char *src, size_t sz) {
+    size_t n = src ? strnlen(src, sz - 1) : 0;
+    memcpy(dst, src, n);
+    dst[n] = '\0';
+}
+
+static void log_rec(int level, int ev, const char *s1, const char *s2,
+                    int a, int status, uint32_t dur_us) {
+    if (level < g_log_level) return;
+
+    uint32_t head = atomic_load_explicit(&g_log_head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&g_log_tail, memory_order_acquire);
+    if (head - tail >= LOG_RING) {
+        atomic_fetch_add_explicit(&g_log_dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    LogRec *r = &g_log_ring[head & (LOG_RING - 1)];
+    r->ts_us = now_us(CLOCK_REALTIME);
+    r->level = (uint8_t)level;
+    r->ev = (uint8_t)ev;
+    r->status = (uint16_t)status;
+    r->dur_us = dur_us;
+    r->a = a;
+    copy_field(r->s1, s1, sizeof(r->s1));
+    copy_field(r->s2, s2, sizeof(r->s2));
+    atomic_store_explicit(&g_log_head, head + 1, memory_order_release);
+}
+
+/* Free-form line for rare events (startup, warnings) */
+static void log_msg(int level, const char *tag, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+static void log_msg(int level, const char *tag, const char *fmt, ...) {
+    if (level < g_log_level) return;
+    char text[sizeof(((LogRec *)0)->s2)];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    log_rec(level, EV_TEXT, tag, text, 0, 0, 0);
+}
+
+static int log_format(const LogRec *r, char *out, int sz) {
+    static const char *lv[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+    time_t sec = (time_t)(r->ts_us / 1000000u);
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    int n = (int)strftime(out, sz, "%Y-%m-%dT%H:%M:%S", &tm);
+    n += snprintf(out + n, sz - n, ".%06uZ %s ",
+                  (unsigned)(r->ts_us % 1000000u), lv[r->level & 3]);
+
+    switch (r->ev) {
+    case EV_JOIN:
+        n += snprintf(out + n, sz - n, "[JOIN] %s (token=%s)\n", r->s1, r->s2);
+        break;
+    case EV_TIMEOUT:
+        n += snprintf(out + n, sz - n, "[TIMEOUT] %s\n", r->s1);
+        break;
+    case EV_ACCESS:
+        n += snprintf(out + n, sz - n, "[HTTP] %s %s %u %dB %uus\n",
+                      r->s1, r->s2, r->status, r->a, r->dur_us);
+        break;
+    default:
+        n += snprintf(out + n, sz - n, "[%s] %s\n", r->s1, r->s2);
+        break;
+    }
+    return n < sz ? n : sz - 1;
+}
+
+static void log_write_all(const char *buf, int len) {
+    while (len > 0) {
+        ssize_t w = write(STDOUT_FILENO, buf, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return;
+        buf += w;
+        len -= (int)w;
+    }
+}
+
+static void *log_main(void *arg) {
+    (void)arg;
+    static char batch[LOG_BATCH_SZ];
+    uint64_t reported = 0;
+
+    for (;;) {
+        uint32_t tail = atomic_load_explicit(&g_log_tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&g_log_head, memory_order_acquire);
+        int len = 0;
+
+        uint64_t dropped = atomic_load_explicit(&g_log_dropped,
+                                                memory_order_relaxed);
+        if (dropped != reported) {
+            len += snprintf(batch, sizeof(batch),
+                "[LOG] %llu records dropped (ring full)\n",
+                (unsigned long long)(dropped - reported));
+            reported = dropped;
+        }
+
+        uint32_t done = tail;
+        while (done != head && len < (int)sizeof(batch) - 256) {
+            len += log_format(&g_log_ring[done & (LOG_RING - 1)],
+                              batch + len, sizeof(batch) - len);
+            done++;
+        }
+        atomic_store_explicit(&g_log_tail, done, memory_order_release);
+
+        if (len > 0) {
+            log_write_all(batch, len);
+            atomic_fetch_add_explicit(&g_log_written, done - tail,
+                                      memory_order_relaxed);
+        }
+        if (done != head) continue;        /* batch was full, keep going */
+
+        if (atomic_load(&g_log_stop)) break;
+        struct timespec ts = { 0, LOG_FLUSH_MS * 1000000L };
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+static void log_start(void) {
+    atomic_store(&g_log_stop, 0);
+    if (pthread_create(&g_log_thread, NULL, log_main, NULL) == 0)
+        g_log_running = 1;
+    else
+        perror("pthread_create(log)");
+}
+
+static void log_init(void) {
+    const char *lvl = getenv("MININ_LOG_LEVEL");
+    if (lvl) {
+        if (strcasecmp(lvl, "debug") == 0)      g_log_level = LV_DEBUG;
+        else if (strcasecmp(lvl, "warn") == 0)  g_log_level = LV_WARN;
+        else if (strcasecmp(lvl, "error") == 0) g_log_level = LV_ERROR;
+    }
+    const char *acc = getenv("MININ_ACCESS_LOG");
+    g_access_log = acc && *acc && strcmp(acc, "0") != 0;
+    log_start();
+}
+
+/* Drain everything still in the ring and stop the writer thread */
+static void log_shutdown(void) {
+    if (!g_log_running) return;
+    atomic_store(&g_log_stop, 1);
+    pthread_join(g_log_thread, NULL);
+    g_log_running = 0;
+}
+
 /* ============================================================
  * UTILITY FUNCTIONS
  * ============================================================ */
@@ -174,6 +408,129 @@ static void json_escape(char *dst, const char *src, int sz) {
     dst[j] = '\0';
 }
 
+/* ============================================================
+ * ROOM MEMBERSHIP + PRESENCE INDEX
+ * ============================================================
+ * Rooms are interned in g_rooms (hash lookup by name) and each one
+ * keeps an intrusive list of its members threaded through Usr, so
+ * joins/leaves are O(1), /users is O(members) and /rooms is
+ * O(rooms). A room can never outnumber the users in it, so the
+ * table is sized by MAX_USR; empty rooms are recycled.
+ *
+ * Every change bumps g_pver and is logged in a ring so clients can
+ * ask for "changes since version N" instead of the full list.
+ */
+typedef struct {
+    char name[RM_SZ];
+    int  head, tail;       /* g_usrs slots, -1 = none */
+    int  count;            /* 0 = free slot */
+    int  hnext;            /* hash chain / free list */
+} Room;
+
+typedef struct {
+    int  ver;
+    char kind;             /* 'j' join, 'l' leave, 'n' nick change */
+    char nick[NK_SZ];
+    char old[NK_SZ];       /* previous nick for 'n' */
+    char room[RM_SZ];
+} PresEv;
+
+static Room   g_rooms[MAX_USR];
+static int    g_rcnt = 0;          /* high-water mark of g_rooms */
+static int    g_rfree = -1;
+static int    g_rhash[ROOM_HASH];
+static int    g_online = 0;
+static PresEv g_plog[PRES_LOG];
+static int    g_pver = 0;
+static int    g_pmin = 0;          /* no deltas below this (hot restart) */
+
+static unsigned room_hash(const char *name) {
+    unsigned h = 2166136261u;
+    for (; *name; name++) h = (h ^ (unsigned char)*name) * 16777619u;
+    return h & (ROOM_HASH - 1);
+}
+
+static void pres_init(void) {
+    for (int i = 0; i < ROOM_HASH; i++) g_rhash[i] = -1;
+}
+
+static void pres_log(char kind, const char *nick, const char *old,
+                     const char *room) {
+    PresEv *e = &g_plog[g_pver % PRES_LOG];
+    memset(e, 0, sizeof(*e));
+    e->ver = ++g_pver;
+    e->kind = kind;
+    strncpy(e->nick, nick, NK_SZ - 1);
+    if (old) strncpy(e->old, old, NK_SZ - 1);
+    strncpy(e->room, room, RM_SZ - 1);
+}
+
+/* Look up a room by name, creating it when create is set */
+static int room_find(const char *name, int create) {
+    unsigned h = room_hash(name);
+    for (int r = g_rhash[h]; r >= 0; r = g_rooms[r].hnext)
+        if (strcmp(g_rooms[r].name, name) == 0) return r;
+    if (!create) return -1;
+
+    int r;
+    if (g_rfree >= 0) { r = g_rfree; g_rfree = g_rooms[r].hnext; }
+    else if (g_rcnt < MAX_USR) r = g_rcnt++;
+    else return -1;
+
+    Room *rm = &g_rooms[r];
+    memset(rm, 0, sizeof(*rm));
+    strncpy(rm->name, name, RM_SZ - 1);
+    rm->head = rm->tail = -1;
+    rm->hnext = g_rhash[h];
+    g_rhash[h] = r;
+    return r;
+}
+
+/* Put u into room name (copied into u->room) */
+static void room_join(Usr *u, const char *name) {
+    strncpy(u->room, name, RM_SZ - 1);
+    u->room[RM_SZ - 1] = '\0';
+
+    int r = room_find(u->room, 1);
+    if (r < 0) { u->rid = -1; return; }   /* unreachable: rooms <= users */
+    Room *rm = &g_rooms[r];
+    int ui = (int)(u - g_usrs);
+
+    u->rid = r;
+    u->rprev = rm->tail;
+    u->rnext = -1;
+    if (rm->tail >= 0) g_usrs[rm->tail].rnext = ui;
+    else rm->head = ui;
+    rm->tail = ui;
+    rm->count++;
+    g_online++;
+
+    pres_log('j', u->nick, NULL, u->room);
+}
+
+/* Remove u from its room; empty rooms go back on the free list */
+static void room_leave(Usr *u) {
+    if (u->rid < 0) return;
+    Room *rm = &g_rooms[u->rid];
+
+    if (u->rprev >= 0) g_usrs[u->rprev].rnext = u->rnext;
+    else rm->head = u->rnext;
+    if (u->rnext >= 0) g_usrs[u->rnext].rprev = u->rprev;
+    else rm->tail = u->rprev;
+    g_online--;
+
+    pres_log('l', u->nick, NULL, u->room);
+
+    if (--rm->count == 0) {
+        int *pp = &g_rhash[room_hash(rm->name)];
+        while (*pp != u->rid) pp = &g_rooms[*pp].hnext;
+        *pp = rm->hnext;
+        rm->hnext = g_rfree;
+        g_rfree = u->rid;
+    }
+    u->rid = u->rprev = u->rnext = -1;
+}
+
 /* ============================================================
  * COBOL INTERFACE (via fork/pipe — no shell injection)
  * ============================================================ */
@@ -229,15 +586,496 @@ static void cobol_call(const char *input, char *output, int outsz) {
     waitpid(pid, &status, 0);
 }
 
+/* ============================================================
+ * MESSAGE RENDERING
+ * ============================================================ */
+
+/* Can user u see message m? Whispers go to sender + target only */
+static int msg_visible(const Msg *m, const Usr *u) {
+    if (m->type == 2)
+        return strcmp(m->nick, u->nick) == 0 ||
+               strcmp(m->target, u->nick) == 0;
+    return strcmp(m->room, u->room) == 0;
+}
+
+/* Render one message as a poll-format JSON object, returns length */
+static int msg_json(const Msg *m, char *out, int sz) {
+    char esc_text[1024], esc_nick[64];
+    json_escape(esc_text, m->text, sizeof(esc_text));
+    json_escape(esc_nick, m->nick, sizeof(esc_nick));
+
+    struct tm *tm = localtime(&m->ts);
+    char timestr[16];
+    strftime(timestr, sizeof(timestr), "%H:%M:%S", tm);
+
+    int n = snprintf(out, sz,
+        "{\"i\":%d,\"n\":\"%s\",\"d\":\"%s\",\"ts\":\"%s\",\"y\":%d}",
+        m->id, esc_nick, esc_text, timestr, m->type);
+    return n < sz ? n : sz - 1;
+}
+
+/* ============================================================
+ * WEBSOCKET TRANSPORT (RFC 6455)
+ * ============================================================
+ * One persistent connection per browser carries login, send and
+ * commands (as url-encoded text frames, e.g. "a=send&m=hi") and
+ * receives messages pushed straight from add_message().
+ */
+typedef struct {
+    int    fd;             /* -1 = free slot */
+    int    uidx;           /* bound g_usrs slot, -1 until login */
+    char   token[TK_SZ + 1];
+    int    inlen;          /* bytes buffered in in[] */
+    int    mlen;           /* bytes of fragmented message so far */
+    int    mop;            /* opcode of message being assembled */
+    int    outlen;         /* bytes queued in out[] */
+    time_t last_io;
+    time_t close_by;       /* closing: drop when out[] drains or by then */
+    unsigned char in[WS_BUF_SZ];
+    char   msg[WS_MSG_SZ];
+    char   out[WS_OUT_SZ];     /* what the socket would not take yet */
+} WsConn;
+
+static WsConn g_ws[MAX_WS];
+static int    g_wscnt = 0;
+
+/* SHA-1, only needed for the Sec-WebSocket-Accept handshake */
+static void sha1(const unsigned char *data, size_t len, unsigned char out[20]) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE,
+                      0x10325476, 0xC3D2E1F0 };
+    unsigned char blk[64];
+    uint64_t bits = (uint64_t)len * 8;
+    size_t total = ((len + 8) / 64 + 1) * 64;
+
+    for (size_t off = 0; off < total; off += 64) {
+        for (int i = 0; i < 64; i++) {
+            size_t p = off + i;
+            if (p < len)                 blk[i] = data[p];
+            else if (p == len)           blk[i] = 0x80;
+            else if (p >= total - 8)     blk[i] = (unsigned char)(bits >> (8 * (total - 1 - p)));
+            else                         blk[i] = 0;
+        }
+
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)blk[4*i] << 24 | (uint32_t)blk[4*i+1] << 16 |
+                   (uint32_t)blk[4*i+2] << 8 | blk[4*i+3];
+        for (int i = 16; i < 80; i++) {
+            uint32_t x = w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16];
+            w[i] = (x << 1) | (x >> 31);
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+            uint32_t t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d; d = c; c = (b << 30) | (b >> 2); b = a; a = t;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for (int i = 0; i < 5; i++) {
+        out[4*i]   = (unsigned char)(h[i] >> 24);
+        out[4*i+1] = (unsigned char)(h[i] >> 16);
+        out[4*i+2] = (unsigned char)(h[i] >> 8);
+        out[4*i+3] = (unsigned char)h[i];
+    }
+}
+
+static void base64(const unsigned char *src, int len, char *dst) {
+    static const char tbl[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int j = 0;
+    for (int i = 0; i < len; i += 3) {
+        uint32_t v = (uint32_t)src[i] << 16;
+        if (i + 1 < len) v |= (uint32_t)src[i+1] << 8;
+        if (i + 2 < len) v |= src[i+2];
+        dst[j++] = tbl[(v >> 18) & 63];
+        dst[j++] = tbl[(v >> 12) & 63];
+        dst[j++] = i + 1 < len ? tbl[(v >> 6) & 63] : '=';
+        dst[j++] = i + 2 < len ? tbl[v & 63] : '=';
+    }
+    dst[j] = '\0';
+}
+
+/*
+ * Write one unmasked server frame (header + payload in a single writev).
+ * WebSocket fds are non-blocking: whatever the socket does not take now
+ * is queued behind earlier output and drained by ws_flush() once the fd
+ * is writable. Returns -1 if the queue would overflow (client too slow).
+ */
+static int ws_send_frame(WsConn *c, int opcode, const char *data, size_t len) {
+    unsigned char hdr[10];
+    int hl = 2;
+    hdr[0] = 0x80 | (opcode & 0x0F);
+    if (len < 126) {
+        hdr[1] = (unsigned char)len;
+    } else if (len <= 0xFFFF) {
+        hdr[1] = 126;
+        hdr[2] = (unsigned char)(len >> 8);
+        hdr[3] = (unsigned char)len;
+        hl = 4;
+    } else {
+        hdr[1] = 127;
+        for (int i = 0; i < 8; i++)
+            hdr[2 + i] = (unsigned char)((uint64_t)len >> (8 * (7 - i)));
+        hl = 10;
+    }
+
+    struct iovec iov[2] = {
+        { hdr, (size_t)hl },
+        { (void *)data, len }
+    };
+    size_t want = hl + len, sent = 0;
+    if (c->outlen == 0) {
+        ssize_t w = writev(c->fd, iov, len ? 2 : 1);
+        if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return -1;
+        if (w > 0) sent = (size_t)w;
+        if (sent == want) return 0;
+    }
+    if (c->outlen + (want - sent) > WS_OUT_SZ) return -1;
+
+    for (int i = 0; i < 2; i++) {
+        size_t n = iov[i].iov_len;
+        if (sent >= n) { sent -= n; continue; }
+        memcpy(c->out + c->outlen, (const char *)iov[i].iov_base + sent, n - sent);
+        c->outlen += (int)(n - sent);
+        sent = 0;
+    }
+    return 0;
+}
+
+static void ws_drop(WsConn *c) {
+    close(c->fd);
+    c->fd = -1;
+    c->uidx = -1;
+    c->outlen = 0;
+    c->close_by = 0;
+    while (g_wscnt > 0 && g_ws[g_wscnt - 1].fd < 0) g_wscnt--;
+}
+
+/* Fd is writable: push out as much of the queue as it takes */
+static void ws_flush(WsConn *c) {
+    ssize_t w = write(c->fd, c->out, c->outlen);
+    if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (w <= 0) { ws_drop(c); return; }
+    memmove(c->out, c->out + w, c->outlen - w);
+    c->outlen -= (int)w;
+    if (c->close_by && c->outlen == 0) ws_drop(c);
+}
+
+/* Queue a close frame; drop now, or once what is queued ahead of it
+ * has drained (ws_flush) or WS_CLOSE_SEC passed (ws_expire) */
+static void ws_send_close(WsConn *c, const char *payload, int len) {
+    if (ws_send_frame(c, 0x8, payload, len) < 0 || c->outlen == 0) {
+        ws_drop(c);
+        return;
+    }
+    c->close_by = time(NULL) + WS_CLOSE_SEC;
+    c->uidx = -1;                      /* no more pushes */
+    c->inlen = 0;
+}
+
+/* Send a close frame with status code, then drop the connection */
+static void ws_close(WsConn *c, int code) {
+    char payload[2] = { (char)(code >> 8), (char)(code & 0xFF) };
+    ws_send_close(c, payload, 2);
+}
+
+/* Drop closing connections whose queue would not drain in time */
+static void ws_expire(time_t now) {
+    for (int i = 0; i < g_wscnt; i++)
+        if (g_ws[i].fd >= 0 && g_ws[i].close_by && now >= g_ws[i].close_by)
+            ws_drop(&g_ws[i]);
+}
+
+static int ws_send_text(WsConn *c, const char *json) {
+    if (c->fd < 0) return -1;
+    if (ws_send_frame(c, 0x1, json, strlen(json)) < 0) {
+        ws_drop(c);
+        return -1;
+    }
+    return 0;
+}
+
+/* Bound user of a connection, or NULL if logged out/timed out */
+static Usr *ws_user(WsConn *c) {
+    if (c->fd < 0 || c->uidx < 0) return NULL;
+    Usr *u = &g_usrs[c->uidx];
+    if (!u->active || strcmp(u->token, c->token) != 0) return NULL;
+    return u;
+}
+
+/* Push a freshly stored message to every connection that may see it.
+ * The frame is built once and written verbatim to each recipient. */
+static void ws_fanout(const Msg *m) {
+    if (g_wscnt == 0) return;
+
+    char frame[1200];
+    int len = 0, built = 0;
+
+    for (int i = 0; i < g_wscnt; i++) {
+        WsConn *c = &g_ws[i];
+        Usr *u = ws_user(c);
+        if (!u || !msg_visible(m, u)) continue;
+
+        if (!built) {
+            len = snprintf(frame, sizeof(frame), "{\"ok\":1,\"msgs\":[");
+            len += msg_json(m, frame + len, sizeof(frame) - len - 2);
+            len += snprintf(frame + len, sizeof(frame) - len, "]}");
+            built = 1;
+        }
+        if (ws_send_frame(c, 0x1, frame, len) < 0)
+            ws_drop(c);
+    }
+}
+
+/* ============================================================
+ * HISTORY SEGMENTS (cold tier)
+ * ============================================================
+ * g_msgs is the hot window. When it fills, the oldest SEG_MSGS
+ * messages are packed into an immutable zlib-compressed segment
+ * file and a fixed-size entry is appended to <dir>/index.bin.
+ * The index is sparse (one entry per segment) and lives on disk,
+ * so memory stays flat however long the history gets.
+ *
+ * The directory is MININ_HIST_DIR (default HIST_DIR). An exclusive
+ * flock() on index.bin marks it as owned: a second instance pointed
+ * at the same directory refuses to start instead of wiping it. The
+ * lock belongs to the open index fd, which hot restart hands over.
+ *
+ * Segment record: id(4) type(1) ts(8) nick\0 room\0 target\0 enc\0
+ * The Fortran ciphertext is stored; text is recovered on read.
+ */
+typedef struct {
+    int32_t  first_id;
+    int32_t  last_id;
+    uint32_t seg;
+    uint32_t count;
+} SegIdx;
+
+static char g_hist_dir[256] = HIST_DIR;
+static int g_idx_fd = -1;
+static int g_nseg = 0;          /* entries in index.bin */
+static int g_arch_cnt = 0;      /* messages moved to segments */
+
+static unsigned char g_seg_raw[SEG_RAW_MAX];
+static unsigned char g_seg_z[SEG_RAW_MAX + SEG_RAW_MAX / 8 + 64];
+static Msg g_seg_msgs[SEG_MSGS];
+
+static int put_str(unsigned char *p, const char *s) {
+    int n = (int)strlen(s) + 1;
+    memcpy(p, s, n);
+    return n;
+}
+
+static int get_str(const unsigned char *p, const unsigned char *end,
+                   char *dst, int sz) {
+    const unsigned char *z = memchr(p, '\0', end - p);
+    if (!z) return -1;
+    int n = (int)(z - p);
+    if (n >= sz) n = sz - 1;
+    memcpy(dst, p, n);
+    dst[n] = '\0';
+    return (int)(z - p) + 1;
+}
+
+/* Serialize one message record, returns bytes written */
+static int msg_pack(const Msg *m, unsigned char *p) {
+    unsigned char *start = p;
+    int32_t id = m->id;
+    int64_t ts = m->ts;
+    memcpy(p, &id, 4); p += 4;
+    *p++ = (unsigned char)m->type;
+    memcpy(p, &ts, 8); p += 8;
+    p += put_str(p, m->nick);
+    p += put_str(p, m->room);
+    p += put_str(p, m->target);
+    p += put_str(p, m->enc);
+    return (int)(p - start);
+}
+
+/* Inverse of msg_pack, decrypting text; returns bytes used or -1 */
+static int msg_unpack(Msg *m, const unsigned char *p, const unsigned char *end) {
+    const unsigned char *start = p;
+    if (end - p < 13) return -1;
+    int32_t id;
+    int64_t ts;
+    memset(m, 0, sizeof(Msg));
+    memcpy(&id, p, 4); p += 4;
+    m->type = *p++;
+    memcpy(&ts, p, 8); p += 8;
+    m->id = id;
+    m->ts = (time_t)ts;
+
+    char *fields[4] = { m->nick, m->room, m->target, m->enc };
+    int sizes[4] = { NK_SZ, RM_SZ, NK_SZ, MSG_SZ };
+    for (int f = 0; f < 4; f++) {
+        int r = get_str(p, end, fields[f], sizes[f]);
+        if (r < 0) return -1;
+        p += r;
+    }
+
+    int elen = (int)strlen(m->enc);
+    int key = CIPHER_KEY;
+    if (elen > 0) {
+        minin_decrypt(m->enc, m->text, &elen, &key);
+        m->text[elen] = '\0';
+    }
+    return (int)(p - start);
+}
+
+static void hist_config(void) {
+    const char *dir = getenv("MININ_HIST_DIR");
+    if (dir && *dir) snprintf(g_hist_dir, sizeof(g_hist_dir), "%s", dir);
+}
+
+/*
+ * Start a fresh history: segments from an older run reuse ids.
+ * Returns -1 only if another live instance owns the directory.
+ */
+static int hist_init(void) {
+    char path[512];
+    mkdir(g_hist_dir, 0700);
+
+    snprintf(path, sizeof(path), "%s/index.bin", g_hist_dir);
+    g_idx_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (g_idx_fd < 0) {
+        log_msg(LV_WARN, "HIST", "disabled: %s: %s", g_hist_dir, strerror(errno));
+        return 0;
+    }
+    if (flock(g_idx_fd, LOCK_EX | LOCK_NB) < 0) {
+        log_msg(LV_ERROR, "HIST", "%s is in use by another server", g_hist_dir);
+        close(g_idx_fd);
+        g_idx_fd = -1;
+        return -1;
+    }
+
+    DIR *d = opendir(g_hist_dir);
+    if (d) {
+        struct dirent *e;
+        while ((e = readdir(d)) != NULL) {
+            if (strncmp(e->d_name, "seg-", 4) != 0) continue;
+            snprintf(path, sizeof(path), "%s/%s", g_hist_dir, e->d_name);
+            unlink(path);
+        }
+        closedir(d);
+    }
+    if (ftruncate(g_idx_fd, 0) < 0) {
+        log_msg(LV_WARN, "HIST", "disabled: %s: %s", g_hist_dir, strerror(errno));
+        close(g_idx_fd);
+        g_idx_fd = -1;
+        return 0;
+    }
+    log_msg(LV_INFO, "INIT", "History segments in %s", g_hist_dir);
+    return 0;
+}
+
+/* Hot restart: keep the segments (and the locked index fd) the
+ * previous process handed over; fd < 0 means history was disabled */
+static void hist_resume(int fd, int nseg, int arch_cnt) {
+    g_idx_fd = fd;
+    g_nseg = nseg;
+    g_arch_cnt = arch_cnt;
+}
+
+/* Pack msgs[0..n) into the next segment file and index it */
+static int hist_spill(const Msg *msgs, int n) {
+    if (g_idx_fd < 0) return -1;
+
+    unsigned char *p = g_seg_raw;
+    for (int i = 0; i < n; i++)
+        p += msg_pack(&msgs[i], p);
+    uLong raw = (uLong)(p - g_seg_raw);
+
+    uLongf zlen = sizeof(g_seg_z);
+    if (compress2(g_seg_z, &zlen, g_seg_raw, raw, Z_BEST_SPEED) != Z_OK)
+        return -1;
+
+    /* Write under a temp name and rename: readers never see a partial file */
+    char path[512], tmp[520];
+    snprintf(path, sizeof(path), "%s/seg-%08d.z", g_hist_dir, g_nseg);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return -1;
+    uint32_t hdr[2] = { (uint32_t)n, (uint32_t)raw };
+    int ok = write(fd, hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr) &&
+             write(fd, g_seg_z, zlen) == (ssize_t)zlen;
+    close(fd);
+    if (!ok || rename(tmp, path) < 0) { unlink(tmp); return -1; }
+
+    SegIdx e = { msgs[0].id, msgs[n - 1].id, (uint32_t)g_nseg, (uint32_t)n };
+    if (write(g_idx_fd, &e, sizeof(e)) != (ssize_t)sizeof(e)) return -1;
+    g_nseg++;
+    g_arch_cnt += n;
+    return 0;
+}
+
+static int hist_index(int i, SegIdx *e) {
+    return pread(g_idx_fd, e, sizeof(*e), (off_t)i * sizeof(*e))
+           == (ssize_t)sizeof(*e) ? 0 : -1;
+}
+
+/* Highest segment whose first_id < before, or -1 */
+static int hist_find(int before) {
+    int lo = 0, hi = g_nseg - 1, found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        SegIdx e;
+        if (hist_index(mid, &e) < 0) return -1;
+        if (e.first_id < before) { found = mid; lo = mid + 1; }
+        else hi = mid - 1;
+    }
+    return found;
+}
+
+/* Decode segment i into g_seg_msgs, returns message count or -1 */
+static int hist_load(int i) {
+    SegIdx e;
+    if (hist_index(i, &e) < 0) return -1;
+
+    char path[512];
+    snprintf(path, sizeof(path), "%s/seg-%08u.z", g_hist_dir, e.seg);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    uint32_t hdr[2];
+    ssize_t zlen = -1;
+    if (read(fd, hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr))
+        zlen = read(fd, g_seg_z, sizeof(g_seg_z));
+    close(fd);
+    if (zlen <= 0 || hdr[0] > SEG_MSGS || hdr[1] > SEG_RAW_MAX) return -1;
+
+    uLongf raw = hdr[1];
+    if (uncompress(g_seg_raw, &raw, g_seg_z, (uLong)zlen) != Z_OK) return -1;
+
+    const unsigned char *p = g_seg_raw, *end = g_seg_raw + raw;
+    int n = (int)hdr[0];
+    for (int k = 0; k < n; k++) {
+        int r = msg_unpack(&g_seg_msgs[k], p, end);
+        if (r < 0) return -1;
+        p += r;
+    }
+    return n;
+}
+
 /* ============================================================
  * MESSAGE STORAGE
  * ============================================================ */
 static int add_message(const char *nick, const char *room,
                        const char *text, int type, const char *target)
 {
-    /* Shift if full */
+    /* Spill the oldest quarter to a segment and shift if full */
     if (g_mcnt >= MAX_MSG) {
-        int shift = MAX_MSG / 4;
+        int shift = SEG_MSGS;
+        if (hist_spill(g_msgs, shift) < 0)
+            log_msg(LV_WARN, "HIST", "spill failed, dropping %d messages", shift);
         memmove(g_msgs, g_msgs + shift, sizeof(Msg) * (MAX_MSG - shift));
         g_mcnt -= shift;
     }
@@ -252,20 +1090,24 @@ static int add_message(const char *nick, const char *room,
     strncpy(m->text, text, MSG_SZ - 1);
     if (target) strncpy(m->target, target, NK_SZ - 1);
 
-    /* Encrypt the message text with Fortran */
-    int len = (int)strlen(text);
+    /* Encrypt the stored (possibly truncated) text with Fortran; cold
+     * segments and the restart snapshot rebuild text from enc alone */
+    int len = (int)strlen(m->text);
     int key = CIPHER_KEY;
-    if (len > 0 && len < MSG_SZ) {
-        minin_encrypt(text, m->enc, &len, &key);
+    if (len > 0) {
+        minin_encrypt(m->text, m->enc, &len, &key);
         m->enc[len] = '\0';
     }
 
+    ws_fanout(m);
     return m->id;
 }
 
 /* ============================================================
  * HTTP RESPONSE HELPERS
  * ============================================================ */
+static int g_resp_status, g_resp_bytes;   /* last response, for access log */
+
 static void send_response(int fd, int code, const char *content_type,
                           const char *body, int body_len)
 {
@@ -274,6 +1116,7 @@ static void send_response(int fd, int code, const char *content_type,
         case 200: reason = "OK"; break;
         case 400: reason = "Bad Request"; break;
         case 404: reason = "Not Found"; break;
+        case 503: reason = "Service Unavailable"; break;
         default:  reason = "Error"; break;
     }
 
@@ -287,8 +1130,11 @@ static void send_response(int fd, int code, const char *content_type,
         "\r\n",
         code, reason, content_type, body_len);
 
-    write(fd, header, hlen);
-    if (body_len > 0) write(fd, body, body_len);
+    /* One segment: header and body must not go out as two packets */
+    struct iovec iov[2] = { { header, hlen }, { (void *)body, body_len } };
+    writev(fd, iov, body_len > 0 ? 2 : 1);
+    g_resp_status = code;
+    g_resp_bytes = hlen + body_len;
 }
 
 static void send_json(int fd, const char *json) {
@@ -314,33 +1160,36 @@ static void load_html(void) {
         g_html_len = (int)fread(g_html, 1, sizeof(g_html) - 1, f);
         g_html[g_html_len] = '\0';
         fclose(f);
-        printf("[INIT] Loaded %s (%d bytes)\n", HTML_FILE, g_html_len);
+        log_msg(LV_INFO, "INIT", "Loaded %s (%d bytes)", HTML_FILE, g_html_len);
     } else {
         g_html_len = snprintf(g_html, sizeof(g_html),
             "<html><body style='background:#000;color:#0f0;font-family:monospace'>"
             "<h1>MININ-CHAT</h1>"
             "<p>Frontend not found at %s</p></body></html>",
             HTML_FILE);
-        printf("[WARN] HTML file not found: %s\n", HTML_FILE);
+        log_msg(LV_WARN, "INIT", "HTML file not found: %s", HTML_FILE);
     }
 }
 
 /* ============================================================
  * API: POST /api/login   body: n=NICKNAME
- * ============================================================ */
-static void handle_login(int fd, const char *body) {
+ * ============================================================
+ * API handlers are transport-independent: they render their JSON
+ * reply into json[] and the caller ships it over HTTP or WebSocket.
+ */
+static Usr *handle_login(const char *body, char *json, int jsz) {
     char nick[NK_SZ] = {0};
     get_param(body, "n", nick, NK_SZ);
 
     if (!nick[0]) {
-        send_json(fd, "{\"ok\":0,\"e\":\"nickname required\"}");
-        return;
+        snprintf(json, jsz, "{\"ok\":0,\"e\":\"nickname required\"}");
+        return NULL;
     }
 
     /* Check duplicate */
     if (find_by_nick(nick)) {
-        send_json(fd, "{\"ok\":0,\"e\":\"nick taken\"}");
-        return;
+        snprintf(json, jsz, "{\"ok\":0,\"e\":\"nick taken\"}");
+        return NULL;
     }
 
     /* Find free slot */
@@ -349,8 +1198,8 @@ static void handle_login(int fd, const char *body) {
         if (!g_usrs[i].active) { idx = i; break; }
     if (idx < 0) {
         if (g_ucnt >= MAX_USR) {
-            send_json(fd, "{\"ok\":0,\"e\":\"server full\"}");
-            return;
+            snprintf(json, jsz, "{\"ok\":0,\"e\":\"server full\"}");
+            return NULL;
         }
         idx = g_ucnt++;
     }
@@ -358,10 +1207,10 @@ static void handle_login(int fd, const char *body) {
     Usr *u = &g_usrs[idx];
     memset(u, 0, sizeof(Usr));
     strncpy(u->nick, nick, NK_SZ - 1);
-    strncpy(u->room, "general", RM_SZ - 1);
     gen_token(u->token);
     u->last_seen = time(NULL);
     u->active = 1;
+    room_join(u, "general");
 
     /* Get MOTD from COBOL */
     char motd_raw[1024] = {0};
@@ -375,32 +1224,32 @@ static void handle_login(int fd, const char *body) {
     add_message("SYSTEM", "general", sysmsg, 1, NULL);
 
     /* Respond */
-    char json[2048], esc_motd[1024];
+    char esc_motd[1024];
     json_escape(esc_motd, motd, sizeof(esc_motd));
-    snprintf(json, sizeof(json),
+    snprintf(json, jsz,
         "{\"ok\":1,\"t\":\"%s\",\"motd\":\"%s\",\"room\":\"general\"}",
         u->token, esc_motd);
-    send_json(fd, json);
 
-    printf("[JOIN] %s (token=%s)\n", nick, u->token);
+    log_rec(LV_INFO, EV_JOIN, nick, u->token, 0, 0, 0);
+    return u;
 }
 
 /* ============================================================
  * API: POST /api/send   body: t=TOKEN&m=MESSAGE
  * ============================================================ */
-static void handle_send(int fd, const char *body) {
+static void handle_send(const char *body, char *json, int jsz) {
     char tok[TK_SZ + 1] = {0}, msg[MSG_SZ] = {0};
     get_param(body, "t", tok, TK_SZ + 1);
     get_param(body, "m", msg, MSG_SZ);
 
     Usr *u = find_by_token(tok);
     if (!u) {
-        send_json(fd, "{\"ok\":0,\"e\":\"not authenticated\"}");
+        snprintf(json, jsz, "{\"ok\":0,\"e\":\"not authenticated\"}");
         return;
     }
 
     if (!msg[0]) {
-        send_json(fd, "{\"ok\":0,\"e\":\"empty message\"}");
+        snprintf(json, jsz, "{\"ok\":0,\"e\":\"empty message\"}");
         return;
     }
 
@@ -414,7 +1263,7 @@ static void handle_send(int fd, const char *body) {
             strncpy(target, msg + 3, tnl);
 
             if (!find_by_nick(target)) {
-                send_json(fd, "{\"ok\":0,\"e\":\"user not found\"}");
+                snprintf(json, jsz, "{\"ok\":0,\"e\":\"user not found\"}");
                 return;
             }
 
@@ -422,7 +1271,7 @@ static void handle_send(int fd, const char *body) {
             snprintf(whisper_text, sizeof(whisper_text),
                 "[whisper] <%s> %s", u->nick, space + 1);
             add_message(u->nick, u->room, whisper_text, 2, target);
-            send_json(fd, "{\"ok\":1}");
+            snprintf(json, jsz, "{\"ok\":1}");
             return;
         }
     }
@@ -440,41 +1289,92 @@ static void handle_send(int fd, const char *body) {
         formatted = msg;
 
     add_message(u->nick, u->room, formatted, 0, NULL);
-    send_json(fd, "{\"ok\":1}");
+    snprintf(json, jsz, "{\"ok\":1}");
+}
+
+/* ============================================================
+ * API: GET /api/poll?t=TOKEN&b=BEFORE_ID   (scrollback)
+ * ============================================================
+ * Returns up to POLL_LIMIT visible messages older than BEFORE_ID,
+ * oldest first, plus "b": the cursor for the next page (0 = done).
+ * Walks the hot window, then at most HIST_SCAN segments backwards.
+ */
+static void handle_history(const Usr *u, int before, char *json, int jsz) {
+    static Msg page[POLL_LIMIT];
+    int count = 0, cursor = before;
+
+    for (int i = g_mcnt - 1; i >= 0 && count < POLL_LIMIT; i--) {
+        const Msg *m = &g_msgs[i];
+        if (m->id >= before) continue;
+        cursor = m->id;
+        if (msg_visible(m, u)) page[count++] = *m;
+    }
+
+    int seg = hist_find(cursor);
+    for (int scanned = 0; seg >= 0 && count < POLL_LIMIT &&
+                          scanned < HIST_SCAN; seg--, scanned++) {
+        int n = hist_load(seg);
+        if (n < 0) {
+            /* Unreadable segment: skip past it rather than stall */
+            SegIdx e;
+            if (hist_index(seg, &e) == 0 && e.first_id < cursor)
+                cursor = e.first_id;
+            continue;
+        }
+        for (int k = n - 1; k >= 0 && count < POLL_LIMIT; k--) {
+            const Msg *m = &g_seg_msgs[k];
+            if (m->id >= cursor) continue;
+            cursor = m->id;
+            if (msg_visible(m, u)) page[count++] = *m;
+        }
+    }
+
+    /* Nothing older than cursor anywhere: scrollback is exhausted */
+    int oldest = g_mcnt > 0 ? g_msgs[0].id : g_next_id;
+    if (g_nseg > 0) {
+        SegIdx e;
+        if (hist_index(0, &e) == 0) oldest = e.first_id;
+    }
+    if (cursor <= oldest) cursor = 0;
+
+    int pos = snprintf(json, jsz, "{\"ok\":1,\"msgs\":[");
+    for (int i = count - 1; i >= 0; i--) {
+        if (i < count - 1) pos += snprintf(json + pos, jsz - pos, ",");
+        pos += msg_json(&page[i], json + pos, jsz - pos);
+    }
+    snprintf(json + pos, jsz - pos, "],\"b\":%d}", cursor);
 }
 
 /* ============================================================
  * API: GET /api/poll?t=TOKEN&a=AFTER_ID
  * ============================================================ */
-static void handle_poll(int fd, const char *qs) {
-    char tok[TK_SZ + 1] = {0}, after_s[16] = {0};
+static void handle_poll(const char *qs, char *json, int jsz) {
+    char tok[TK_SZ + 1] = {0}, after_s[16] = {0}, before_s[16] = {0};
     get_param(qs, "t", tok, TK_SZ + 1);
     get_param(qs, "a", after_s, 16);
+    get_param(qs, "b", before_s, 16);
     int after = atoi(after_s);
 
     Usr *u = find_by_token(tok);
     if (!u) {
-        send_json(fd, "{\"ok\":0}");
+        snprintf(json, jsz, "{\"ok\":0}");
+        return;
+    }
+
+    if (atoi(before_s) > 0) {
+        handle_history(u, atoi(before_s), json, jsz);
         return;
     }
 
-    char json[65536];
     int pos = 0;
-    pos += snprintf(json + pos, sizeof(json) - pos, "{\"ok\":1,\"msgs\":[");
+    pos += snprintf(json + pos, jsz - pos, "{\"ok\":1,\"msgs\":[");
 
     int count = 0;
     for (int i = 0; i < g_mcnt && count < POLL_LIMIT; i++) {
         Msg *m = &g_msgs[i];
         if (m->id <= after) continue;
 
-        if (m->type == 2) {
-            if (strcmp(m->nick, u->nick) != 0 &&
-                strcmp(m->target, u->nick) != 0)
-                continue;
-        } else {
-            if (strcmp(m->room, u->room) != 0)
-                continue;
-        }
+        if (!msg_visible(m, u)) continue;
 
         char decrypted[MSG_SZ] = {0};
         int elen = (int)strlen(m->enc);
@@ -484,54 +1384,99 @@ static void handle_poll(int fd, const char *qs) {
             decrypted[elen] = '\0';
         }
 
-        char esc_text[1024], esc_nick[64];
-        json_escape(esc_text, m->text, sizeof(esc_text));
-        json_escape(esc_nick, m->nick, sizeof(esc_nick));
+        if (count > 0) pos += snprintf(json + pos, jsz - pos, ",");
+        pos += msg_json(m, json + pos, jsz - pos);
+        count++;
+    }
+
+    pos += snprintf(json + pos, jsz - pos, "]}");
+}
 
-        struct tm *tm = localtime(&m->ts);
-        char timestr[16];
-        strftime(timestr, sizeof(timestr), "%H:%M:%S", tm);
+/* ============================================================
+ * API: GET /api/presence?t=TOKEN&v=VERSION
+ * ============================================================
+ * Changes since VERSION as {"v":N,"ch":[{"k","n","o","r"},...]}.
+ * v=0, or a version that fell out of the change ring, gets the
+ * full room list instead: {"v":N,"full":1,"rooms":[{"r","u"}]}.
+ */
+static void handle_presence(const char *qs, char *json, int jsz) {
+    char tok[TK_SZ + 1] = {0}, ver_s[16] = {0};
+    get_param(qs, "t", tok, TK_SZ + 1);
+    get_param(qs, "v", ver_s, 16);
+    int since = atoi(ver_s);
 
-        if (count > 0) pos += snprintf(json + pos, sizeof(json) - pos, ",");
-        pos += snprintf(json + pos, sizeof(json) - pos,
-            "{\"i\":%d,\"n\":\"%s\",\"d\":\"%s\",\"ts\":\"%s\",\"y\":%d}",
-            m->id, esc_nick, esc_text, timestr, m->type);
-        count++;
+    if (!find_by_token(tok)) {
+        snprintf(json, jsz, "{\"ok\":0,\"e\":\"not authenticated\"}");
+        return;
     }
 
-    pos += snprintf(json + pos, sizeof(json) - pos, "]}");
-    send_json(fd, json);
+    char esc_a[64], esc_b[64], esc_r[64];
+    int pos;
+
+    if (since <= 0 || since > g_pver || since < g_pver - PRES_LOG ||
+        since < g_pmin) {
+        pos = snprintf(json, jsz, "{\"ok\":1,\"v\":%d,\"full\":1,\"rooms\":[",
+                       g_pver);
+        int first = 1;
+        for (int r = 0; r < g_rcnt && pos < jsz - 128; r++) {
+            if (!g_rooms[r].count) continue;
+            json_escape(esc_r, g_rooms[r].name, sizeof(esc_r));
+            pos += snprintf(json + pos, jsz - pos, "%s{\"r\":\"%s\",\"u\":[",
+                            first ? "" : ",", esc_r);
+            first = 0;
+            for (int i = g_rooms[r].head; i >= 0 && pos < jsz - 128;
+                 i = g_usrs[i].rnext) {
+                json_escape(esc_a, g_usrs[i].nick, sizeof(esc_a));
+                pos += snprintf(json + pos, jsz - pos, "%s\"%s\"",
+                                i == g_rooms[r].head ? "" : ",", esc_a);
+            }
+            pos += snprintf(json + pos, jsz - pos, "]}");
+        }
+        snprintf(json + pos, jsz - pos, "]}");
+        return;
+    }
+
+    pos = snprintf(json, jsz, "{\"ok\":1,\"v\":%d,\"ch\":[", g_pver);
+    for (int v = since + 1; v <= g_pver && pos < jsz - 160; v++) {
+        const PresEv *e = &g_plog[(v - 1) % PRES_LOG];
+        json_escape(esc_a, e->nick, sizeof(esc_a));
+        json_escape(esc_b, e->old, sizeof(esc_b));
+        json_escape(esc_r, e->room, sizeof(esc_r));
+        pos += snprintf(json + pos, jsz - pos,
+            "%s{\"k\":\"%c\",\"n\":\"%s\",\"o\":\"%s\",\"r\":\"%s\"}",
+            v == since + 1 ? "" : ",", e->kind, esc_a, esc_b, esc_r);
+    }
+    snprintf(json + pos, jsz - pos, "]}");
 }
 
 /* ============================================================
  * API: POST /api/cmd   body: t=TOKEN&c=COMMAND
  * ============================================================ */
-static void handle_cmd(int fd, const char *body) {
+static void handle_cmd(const char *body, char *json, int jsz) {
     char tok[TK_SZ + 1] = {0}, cmd[256] = {0};
     get_param(body, "t", tok, TK_SZ + 1);
     get_param(body, "c", cmd, 256);
 
     Usr *u = find_by_token(tok);
     if (!u) {
-        send_json(fd, "{\"ok\":0,\"e\":\"not authenticated\"}");
+        snprintf(json, jsz, "{\"ok\":0,\"e\":\"not authenticated\"}");
         return;
     }
 
-    char json[4096];
-
     /* /nick NEW_NAME */
     if (strncmp(cmd, "nick ", 5) == 0) {
         char *nn = cmd + 5;
         if (find_by_nick(nn)) {
-            snprintf(json, sizeof(json),
+            snprintf(json, jsz,
                 "{\"ok\":0,\"e\":\"nick '%s' already taken\"}", nn);
         } else {
             char sysmsg[128];
             snprintf(sysmsg, sizeof(sysmsg),
                 "%s is now known as %s", u->nick, nn);
             add_message("SYSTEM", u->room, sysmsg, 1, NULL);
+            pres_log('n', nn, u->nick, u->room);
             strncpy(u->nick, nn, NK_SZ - 1);
-            snprintf(json, sizeof(json), "{\"ok\":1}");
+            snprintf(json, jsz, "{\"ok\":1}");
         }
     }
     /* /join ROOM */
@@ -541,51 +1486,37 @@ static void handle_cmd(int fd, const char *body) {
         snprintf(sysmsg, sizeof(sysmsg), "%s left #%s", u->nick, u->room);
         add_message("SYSTEM", u->room, sysmsg, 1, NULL);
 
-        strncpy(u->room, nr, RM_SZ - 1);
+        room_leave(u);
+        room_join(u, nr);
 
         snprintf(sysmsg, sizeof(sysmsg), "%s joined #%s", u->nick, u->room);
         add_message("SYSTEM", u->room, sysmsg, 1, NULL);
-        snprintf(json, sizeof(json), "{\"ok\":1}");
+        snprintf(json, jsz, "{\"ok\":1}");
     }
     /* /users */
     else if (strcmp(cmd, "users") == 0) {
-        int pos = snprintf(json, sizeof(json),
+        int pos = snprintf(json, jsz,
             "{\"ok\":1,\"d\":\"== Users in #%s == ", u->room);
-        for (int i = 0; i < g_ucnt; i++) {
-            if (g_usrs[i].active &&
-                strcmp(g_usrs[i].room, u->room) == 0) {
-                pos += snprintf(json + pos, sizeof(json) - pos,
-                    "%s ", g_usrs[i].nick);
-            }
+        int i = u->rid >= 0 ? g_rooms[u->rid].head : -1;
+        for (; i >= 0 && pos < jsz - 64; i = g_usrs[i].rnext) {
+            char esc_nick[64];
+            json_escape(esc_nick, g_usrs[i].nick, sizeof(esc_nick));
+            pos += snprintf(json + pos, jsz - pos, "%s ", esc_nick);
         }
-        pos += snprintf(json + pos, sizeof(json) - pos, "\"}");
+        pos += snprintf(json + pos, jsz - pos, "\"}");
     }
     /* /rooms */
     else if (strcmp(cmd, "rooms") == 0) {
-        char rooms[32][RM_SZ];
-        int counts[32] = {0};
-        int rc = 0;
-
-        for (int i = 0; i < g_ucnt; i++) {
-            if (!g_usrs[i].active) continue;
-            int found = -1;
-            for (int j = 0; j < rc; j++)
-                if (strcmp(rooms[j], g_usrs[i].room) == 0) { found = j; break; }
-            if (found >= 0) {
-                counts[found]++;
-            } else if (rc < 32) {
-                strncpy(rooms[rc], g_usrs[i].room, RM_SZ - 1);
-                counts[rc] = 1;
-                rc++;
-            }
-        }
-
-        int pos = snprintf(json, sizeof(json),
+        int pos = snprintf(json, jsz,
             "{\"ok\":1,\"d\":\"== Active Rooms == ");
-        for (int i = 0; i < rc; i++)
-            pos += snprintf(json + pos, sizeof(json) - pos,
-                "#%s(%d) ", rooms[i], counts[i]);
-        pos += snprintf(json + pos, sizeof(json) - pos, "\"}");
+        for (int i = 0; i < g_rcnt && pos < jsz - 64; i++) {
+            if (!g_rooms[i].count) continue;
+            char esc_room[64];
+            json_escape(esc_room, g_rooms[i].name, sizeof(esc_room));
+            pos += snprintf(json + pos, jsz - pos,
+                "#%s(%d) ", esc_room, g_rooms[i].count);
+        }
+        pos += snprintf(json + pos, jsz - pos, "\"}");
     }
     /* /status */
     else if (strcmp(cmd, "status") == 0) {
@@ -598,40 +1529,703 @@ static void handle_cmd(int fd, const char *body) {
         char esc_cs[512];
         json_escape(esc_cs, cs, sizeof(esc_cs));
 
-        int online = 0;
-        for (int i = 0; i < g_ucnt; i++)
-            if (g_usrs[i].active) online++;
-
-        snprintf(json, sizeof(json),
+        snprintf(json, jsz,
             "{\"ok\":1,\"d\":\"== SERVER STATUS == "
-            "Online: %d | Messages: %d | "
+            "Online: %d | Messages: %d (+%d archived) | "
             "Encryption: Fortran XOR-PRNG (key=0x%X) | "
-            "Formatter: %s\"}",
-            online, g_mcnt, CIPHER_KEY, esc_cs);
+            "Formatter: %s | "
+            "Log: %llu written, %llu dropped\"}",
+            g_online, g_mcnt, g_arch_cnt, CIPHER_KEY, esc_cs,
+            (unsigned long long)atomic_load(&g_log_written),
+            (unsigned long long)atomic_load(&g_log_dropped));
     }
     else {
-        snprintf(json, sizeof(json),
+        snprintf(json, jsz,
             "{\"ok\":0,\"e\":\"unknown command\"}");
     }
+}
 
-    send_json(fd, json);
+/* ============================================================
+ * REQUEST TRACE CAPTURE (MININ_TRACE=file)
+ * ============================================================
+ * Appends every HTTP request (method, target, body, arrival time,
+ * issued login token) to a binary trace for ./replay. WebSocket
+ * frames are recorded as their HTTP equivalents (see ws_trace()),
+ * user timeouts as POST /api/timeout. Records go through a large
+ * stdio buffer, flushed when idle, on the cleanup tick and at exit.
+ *
+ * MININ_REPLAY=1 marks a replay target: users time out only through
+ * /api/timeout from the trace, never by the clock.
+ */
+static FILE *g_trace = NULL;
+static int   g_replay = 0;
+
+static void trace_init(void) {
+    const char *replay = getenv("MININ_REPLAY");
+    g_replay = replay && strcmp(replay, "1") == 0;
+    if (g_replay) log_msg(LV_INFO, "INIT", "Replay target: clock timeouts off");
+
+    const char *path = getenv("MININ_TRACE");
+    if (!path || !*path) return;
+
+    g_trace = fopen(path, "ae");
+    if (!g_trace) {
+        log_msg(LV_WARN, "TRACE", "cannot open %s: %s", path, strerror(errno));
+        return;
+    }
+    setvbuf(g_trace, NULL, _IOFBF, 1 << 16);
+
+    /* A hot-restarted process keeps appending to the same trace */
+    if (ftell(g_trace) == 0) {
+        TraceFileHdr h = { TRACE_MAGIC, TRACE_VERSION };
+        fwrite(&h, sizeof(h), 1, g_trace);
+        fflush(g_trace);
+    }
+    log_msg(LV_INFO, "INIT", "Tracing requests to %s", path);
+}
+
+static void trace_flush(void) {
+    if (g_trace) fflush(g_trace);
+}
+
+static void trace_request(uint64_t t_us, const char *method,
+                          const char *target, const char *body, int body_len,
+                          const char *token) {
+    TraceRecHdr h;
+    memset(&h, 0, sizeof(h));
+    h.t_us = t_us;
+    h.method_len = (uint16_t)strlen(method);
+    h.target_len = (uint16_t)strlen(target);
+    h.body_len = (uint32_t)(body_len > 0 ? body_len : 0);
+    if (token) memcpy(h.token, token, TRACE_TK_SZ);
+
+    fwrite(&h, sizeof(h), 1, g_trace);
+    fwrite(method, 1, h.method_len, g_trace);
+    fwrite(target, 1, h.target_len, g_trace);
+    fwrite(body, 1, h.body_len, g_trace);
+}
+
+/* ============================================================
+ * API: GET /api/state
+ * ============================================================
+ * FNV-1a checksum over the deterministic parts of g_msgs and
+ * g_usrs, so a replay can be compared with the original run.
+ * Tokens, timestamps and the COBOL "[HH:MM:SS] " prefix are
+ * left out because they differ between runs. Served only with
+ * MININ_TRACE or MININ_REPLAY set.
+ */
+static uint64_t fnv64(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+static uint64_t fnv64s(uint64_t h, const char *s) {
+    return fnv64(h, s, strlen(s) + 1);
+}
+
+static void handle_state(char *json, int jsz) {
+    uint64_t h = 14695981039346656037ULL;
+    h = fnv64(h, &g_next_id, sizeof(g_next_id));
+
+    for (int i = 0; i < g_mcnt; i++) {
+        const Msg *m = &g_msgs[i];
+        const char *text = m->text;
+        if (m->type == 0 && text[0] == '[' && strlen(text) > 11 &&
+            text[3] == ':' && text[6] == ':' && text[9] == ']')
+            text += 11;
+        h = fnv64(h, &m->id, sizeof(m->id));
+        h = fnv64(h, &m->type, sizeof(m->type));
+        h = fnv64s(h, m->nick);
+        h = fnv64s(h, m->room);
+        h = fnv64s(h, m->target);
+        h = fnv64s(h, text);
+    }
+
+    int users = 0;
+    for (int i = 0; i < g_ucnt; i++) {
+        const Usr *u = &g_usrs[i];
+        if (!u->active) continue;
+        h = fnv64s(h, u->nick);
+        h = fnv64s(h, u->room);
+        users++;
+    }
+
+    snprintf(json, jsz,
+        "{\"ok\":1,\"next_id\":%d,\"msgs\":%d,\"users\":%d,"
+        "\"sum\":\"%016llx\"}",
+        g_next_id, g_mcnt, users, (unsigned long long)h);
+}
+
+/* ============================================================
+ * API: POST /api/timeout   body: t=TOKEN   (MININ_REPLAY only)
+ * ============================================================ */
+static void user_timeout(Usr *u) {
+    char sysmsg[128];
+    snprintf(sysmsg, sizeof(sysmsg), "%s timed out", u->nick);
+    add_message("SYSTEM", u->room, sysmsg, 1, NULL);
+    room_leave(u);
+    u->active = 0;
+    log_rec(LV_INFO, EV_TIMEOUT, u->nick, NULL, 0, 0, 0);
+
+    if (g_trace) {
+        char body[TK_SZ + 3];
+        int n = snprintf(body, sizeof(body), "t=%s", u->token);
+        trace_request(now_us(CLOCK_MONOTONIC), "POST", "/api/timeout",
+                      body, n, NULL);
+    }
+}
+
+static void handle_timeout(const char *body, char *json, int jsz) {
+    char tok[TK_SZ + 1] = {0};
+    get_param(body, "t", tok, TK_SZ + 1);
+
+    Usr *u = find_by_token(tok);
+    if (!u) {
+        snprintf(json, jsz, "{\"ok\":0,\"e\":\"not authenticated\"}");
+        return;
+    }
+    user_timeout(u);
+    snprintf(json, jsz, "{\"ok\":1}");
+}
+
+/* ============================================================
+ * WEBSOCKET: HANDSHAKE + FRAME PROCESSING
+ * ============================================================ */
+
+/* Upgrade an HTTP request to a WebSocket; returns 1 if fd was adopted */
+static int ws_handshake(int fd, const char *req) {
+    const char *up = strcasestr(req, "\r\nUpgrade:");
+    const char *kh = strcasestr(req, "\r\nSec-WebSocket-Key:");
+    if (!up || !kh || !strcasestr(up, "websocket")) {
+        send_response(fd, 400, "text/plain", "400 Bad Request", 15);
+        return 0;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < MAX_WS; i++)
+        if (i >= g_wscnt || g_ws[i].fd < 0) { slot = i; break; }
+    if (slot < 0) {
+        send_response(fd, 503, "text/plain", "503 Busy", 8);
+        return 0;
+    }
+
+    char key[64] = {0};
+    kh += 20;
+    while (*kh == ' ') kh++;
+    int kl = 0;
+    while (kh[kl] && kh[kl] != '\r' && kh[kl] != ' ' && kl < 40) kl++;
+    memcpy(key, kh, kl);
+
+    char cat[128];
+    unsigned char digest[20];
+    char accept[32];
+    int cl = snprintf(cat, sizeof(cat), "%s" WS_GUID, key);
+    sha1((const unsigned char *)cat, cl, digest);
+    base64(digest, 20, accept);
+
+    char hdr[256];
+    int hl = snprintf(hdr, sizeof(hdr),
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n"
+        "\r\n", accept);
+    if (write(fd, hdr, hl) != hl) return 0;
+
+    /* A stuck client must never block the loop; see ws_send_frame() */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    WsConn *c = &g_ws[slot];
+    c->fd = fd;
+    c->uidx = -1;
+    c->token[0] = '\0';
+    c->inlen = c->mlen = c->mop = c->outlen = 0;
+    c->last_io = time(NULL);
+    c->close_by = 0;
+    if (slot >= g_wscnt) g_wscnt = slot + 1;
+    return 1;
+}
+
+/*
+ * Trace a frame as the HTTP request it stands for, so ./replay drives
+ * the same handlers over plain HTTP. tok is the token bound when the
+ * frame arrived. Frames with no HTTP equivalent (unknown action, hist
+ * without b) changed nothing and are left out.
+ */
+static void ws_trace(uint64_t t0, const char *action, const char *tok,
+                     const char *payload, const char *issued) {
+    static char buf[WS_MSG_SZ + 64];
+    char arg[16] = {0};
+    int n;
+
+    if (strcmp(action, "login") == 0) {
+        trace_request(t0, "POST", "/api/login", payload, (int)strlen(payload),
+                      issued);
+    } else if (strcmp(action, "send") == 0 || strcmp(action, "cmd") == 0) {
+        n = snprintf(buf, sizeof(buf), "t=%s&%s", tok, payload);
+        trace_request(t0, "POST", action[0] == 's' ? "/api/send" : "/api/cmd",
+                      buf, n < (int)sizeof(buf) ? n : (int)sizeof(buf) - 1, NULL);
+    } else if (strcmp(action, "hist") == 0) {
+        get_param(payload, "b", arg, sizeof(arg));
+        if (atoi(arg) <= 0) return;
+        snprintf(buf, sizeof(buf), "/api/poll?t=%s&b=%s", tok, arg);
+        trace_request(t0, "GET", buf, "", 0, NULL);
+    } else if (strcmp(action, "presence") == 0) {
+        get_param(payload, "v", arg, sizeof(arg));
+        snprintf(buf, sizeof(buf), "/api/presence?t=%s&v=%s", tok, arg);
+        trace_request(t0, "GET", buf, "", 0, NULL);
+    }
+}
+
+/* Handle one text message; returns the token issued by a=login */
+static const char *ws_handle(WsConn *c, const char *action, const char *payload) {
+    static char json[65536];
+
+    if (strcmp(action, "login") == 0) {
+        Usr *u = handle_login(payload, json, sizeof(json));
+        if (!u) {
+            ws_send_text(c, json);
+            return NULL;
+        }
+        c->uidx = (int)(u - g_usrs);
+        strcpy(c->token, u->token);
+        if (ws_send_text(c, json) == 0) {
+            /* Backlog for the room, same as a first poll */
+            char qs[64];
+            snprintf(qs, sizeof(qs), "t=%s&a=0", u->token);
+            handle_poll(qs, json, sizeof(json));
+            ws_send_text(c, json);
+        }
+        return u->token;
+    }
+
+    Usr *u = ws_user(c);
+    if (!u) {
+        ws_send_text(c, "{\"ok\":0,\"e\":\"not authenticated\"}");
+        return NULL;
+    }
+    u->last_seen = time(NULL);
+
+    /* Bound token goes first so a client-supplied t= never wins */
+    char req[WS_MSG_SZ + 32];
+    snprintf(req, sizeof(req), "t=%s&%s", c->token, payload);
+
+    if (strcmp(action, "send") == 0)
+        handle_send(req, json, sizeof(json));
+    else if (strcmp(action, "cmd") == 0)
+        handle_cmd(req, json, sizeof(json));
+    else if (strcmp(action, "hist") == 0) {
+        /* Backfill only: a plain poll reply would look like a push */
+        char before[16] = {0};
+        get_param(payload, "b", before, sizeof(before));
+        if (atoi(before) > 0)
+            handle_poll(req, json, sizeof(json));
+        else
+            snprintf(json, sizeof(json), "{\"ok\":0,\"e\":\"b required\"}");
+    } else if (strcmp(action, "presence") == 0)
+        handle_presence(req, json, sizeof(json));
+    else
+        snprintf(json, sizeof(json), "{\"ok\":0,\"e\":\"unknown action\"}");
+    ws_send_text(c, json);
+    return NULL;
+}
+
+/* Dispatch one complete text message: a=login|send|cmd|hist|presence */
+static void ws_dispatch(WsConn *c, const char *payload) {
+    uint64_t t0 = g_trace ? now_us(CLOCK_MONOTONIC) : 0;
+    char action[16] = {0}, tok[TK_SZ + 1];
+    get_param(payload, "a", action, sizeof(action));
+    memcpy(tok, c->token, sizeof(tok));
+
+    const char *issued = ws_handle(c, action, payload);
+    if (g_trace)
+        ws_trace(t0, action, tok, payload, issued);
+}
+
+/* Read what is available and process every complete frame */
+static void ws_read(WsConn *c) {
+    int n = read(c->fd, c->in + c->inlen, WS_BUF_SZ - c->inlen);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if (n <= 0) { ws_drop(c); return; }
+    if (c->close_by) return;           /* closing: discard until EOF */
+    c->inlen += n;
+    c->last_io = time(NULL);
+
+    Usr *bu = ws_user(c);
+    if (bu) bu->last_seen = c->last_io;
+
+    int off = 0;
+    while (c->fd >= 0 && !c->close_by) {
+        unsigned char *p = c->in + off;
+        int avail = c->inlen - off;
+        if (avail < 2) break;
+
+        int fin = p[0] & 0x80, op = p[0] & 0x0F;
+        int masked = p[1] & 0x80;
+        uint64_t plen = p[1] & 0x7F;
+        int hl = 2;
+        if (plen == 126) {
+            if (avail < 4) break;
+            plen = (uint64_t)p[2] << 8 | p[3];
+            hl = 4;
+        } else if (plen == 127) {
+            if (avail < 10) break;
+            plen = 0;
+            for (int i = 0; i < 8; i++) plen = plen << 8 | p[2 + i];
+            hl = 10;
+        }
+
+        /* Clients must mask; control frames are short and unfragmented */
+        if (!masked || (p[0] & 0x70)) { ws_close(c, 1002); return; }
+        if (op >= 0x8 && (plen > 125 || !fin)) { ws_close(c, 1002); return; }
+        if (plen > WS_MSG_SZ - 1) { ws_close(c, 1009); return; }
+        if ((uint64_t)avail < hl + 4 + plen) break;
+
+        unsigned char *mask = p + hl;
+        unsigned char *data = p + hl + 4;
+        for (uint64_t i = 0; i < plen; i++) data[i] ^= mask[i & 3];
+        off += hl + 4 + (int)plen;
+
+        if (op == 0x8) {
+            ws_send_close(c, (char *)data, plen >= 2 ? 2 : 0);
+            return;
+        } else if (op == 0x9) {
+            if (ws_send_frame(c, 0xA, (char *)data, plen) < 0) {
+                ws_drop(c);
+                return;
+            }
+            continue;
+        } else if (op == 0xA) {
+            continue;
+        } else if (op == 0x1 || op == 0x2) {
+            if (c->mop) { ws_close(c, 1002); return; }
+            c->mop = op;
+            c->mlen = 0;
+        } else if (op != 0x0 || !c->mop) {
+            ws_close(c, 1002);
+            return;
+        }
+
+        if (c->mlen + (int)plen > WS_MSG_SZ - 1) { ws_close(c, 1009); return; }
+        memcpy(c->msg + c->mlen, data, plen);
+        c->mlen += (int)plen;
+        if (!fin) continue;
+
+        int mop = c->mop;
+        c->mop = 0;
+        if (mop != 0x1) { ws_close(c, 1003); return; }
+        c->msg[c->mlen] = '\0';
+        ws_dispatch(c, c->msg);
+    }
+
+    if (c->fd >= 0 && !c->close_by) {
+        memmove(c->in, c->in + off, c->inlen - off);
+        c->inlen -= off;
+    }
+}
+
+/* Keepalive: ping idle connections, drop dead ones */
+static void ws_keepalive(void) {
+    time_t now = time(NULL);
+    for (int i = 0; i < g_wscnt; i++) {
+        WsConn *c = &g_ws[i];
+        if (c->fd < 0 || c->close_by) continue;
+        if (now - c->last_io > TIMEOUT_SEC)
+            ws_drop(c);
+        else if (now - c->last_io >= WS_PING_SEC &&
+                 ws_send_frame(c, 0x9, "", 0) < 0)
+            ws_drop(c);
+    }
+}
+
+/* ============================================================
+ * LISTENERS + PROXY PROTOCOL
+ * ============================================================
+ * Any mix of TCP and Unix-socket listeners, e.g. behind nginx:
+ *
+ *   MININ_LISTEN="tcp:127.0.0.1:3000 unix:/run/minin/chat.sock,proxy"
+ *
+ * tcp:[HOST:]PORT (HOST may be [v6]) or unix:PATH; ",proxy" makes the
+ * listener require a PROXY protocol v1/v2 header and take the client
+ * address from it. Without MININ_LISTEN: tcp:0.0.0.0:MININ_PORT.
+ *   MININ_BACKLOG   listen() backlog
+ *   MININ_BUF_SZ    request buffer (max request size)
+ *   MININ_SNDBUF / MININ_RCVBUF   socket buffers, 0 = kernel default
+ *   MININ_UNIX_MODE unix: socket permissions, octal (0660)
+ */
+typedef struct {
+    int  fd;
+    int  proxy;            /* expect a PROXY header first */
+    char name[112];        /* spec as given, for logs */
+} Listener;
+
+static Listener g_lst[MAX_LISTEN];
+static int      g_nlst = 0;
+static int      g_backlog = BACKLOG;
+static int      g_buf_sz = BUF_SZ;
+static int      g_sndbuf = 0, g_rcvbuf = 0;
+static int      g_unix_mode = UNIX_MODE;
+static char    *g_reqbuf;
+
+static const char PROXY_V2_SIG[12] = "\r\n\r\n\0\r\nQUIT\n";
+
+static int env_int(const char *name, int def, int min, int max) {
+    const char *v = getenv(name);
+    if (!v || !*v) return def;
+    int n = atoi(v);
+    if (n < min || n > max) {
+        log_msg(LV_WARN, "INIT", "%s=%s out of range, using %d", name, v, def);
+        return def;
+    }
+    return n;
+}
+
+/* Bind one "tcp:..." or "unix:..." spec; returns the fd or -1 */
+static int listen_open(const char *spec) {
+    int fd = -1, one = 1;
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (!spec[5] || strlen(spec + 5) >= sizeof(sa.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(sa.sun_path, spec + 5);
+
+        /*
+         * A socket file left by a previous run would make bind() fail.
+         * Remove it only if nobody answers: a live server's path is
+         * in use (EAGAIN means it answers but its backlog is full).
+         */
+        struct stat st;
+        if (lstat(sa.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0) return -1;
+            int stale = connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 &&
+                        errno == ECONNREFUSED;
+            close(fd);
+            if (!stale) { errno = EADDRINUSE; return -1; }
+            unlink(sa.sun_path);
+        }
+
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+            chmod(sa.sun_path, (mode_t)g_unix_mode) < 0)
+            goto fail;
+    } else if (strncmp(spec, "tcp:", 4) == 0) {
+        char host[64], *h = host, *port;
+        if (strlen(spec + 4) >= sizeof(host)) { errno = EINVAL; return -1; }
+        strcpy(host, spec + 4);
+        port = strrchr(host, ':');
+        if (port) {
+            *port++ = '\0';
+        } else {
+            port = host;               /* "tcp:PORT" */
+            h = NULL;
+        }
+        if (h && h[0] == '[') {        /* [v6]:port */
+            h++;
+            char *e = strchr(h, ']');
+            if (e) *e = '\0';
+        }
+        if (h && (!*h || strcmp(h, "*") == 0)) h = NULL;
+
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = h ? AF_UNSPEC : AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+        int rc = getaddrinfo(h, port, &hints, &res);
+        if (rc != 0) { errno = EINVAL; return -1; }
+
+        fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, 0);
+        if (fd < 0) { freeaddrinfo(res); return -1; }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (res->ai_family == AF_INET6)    /* let [::] and 0.0.0.0 coexist */
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+        rc = bind(fd, res->ai_addr, res->ai_addrlen);
+        freeaddrinfo(res);
+        if (rc < 0) goto fail;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Accepted sockets inherit the listener's buffer sizes */
+    if (g_sndbuf > 0) setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &g_sndbuf, sizeof(int));
+    if (g_rcvbuf > 0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &g_rcvbuf, sizeof(int));
+    if (listen(fd, g_backlog) < 0) goto fail;
+    return fd;
+
+fail:
+    {
+        int e = errno;
+        close(fd);
+        errno = e;
+    }
+    return -1;
+}
+
+/* Read runtime settings and open every configured listener */
+static int listen_init(void) {
+    g_backlog = env_int("MININ_BACKLOG", BACKLOG, 1, 65535);
+    g_sndbuf = env_int("MININ_SNDBUF", 0, 0, 1 << 26);
+    g_rcvbuf = env_int("MININ_RCVBUF", 0, 0, 1 << 26);
+
+    const char *mode = getenv("MININ_UNIX_MODE");
+    if (mode && *mode) {
+        char *end;
+        long m = strtol(mode, &end, 8);
+        if (*end || m < 0 || m > 0777)
+            log_msg(LV_WARN, "INIT", "MININ_UNIX_MODE=%s invalid, using %o",
+                    mode, UNIX_MODE);
+        else
+            g_unix_mode = (int)m;
+    }
+
+    char def[32], specs[1024];
+    snprintf(def, sizeof(def), "tcp:0.0.0.0:%d",
+             env_int("MININ_PORT", PORT, 1, 65535));
+    const char *env = getenv("MININ_LISTEN");
+    snprintf(specs, sizeof(specs), "%s", env && *env ? env : def);
+
+    char *save = NULL;
+    for (char *tok = strtok_r(specs, " \t\n;", &save); tok;
+         tok = strtok_r(NULL, " \t\n;", &save)) {
+        if (g_nlst >= MAX_LISTEN) {
+            log_msg(LV_WARN, "INIT", "more than %d listeners, ignoring %s",
+                    MAX_LISTEN, tok);
+            break;
+        }
+        Listener *l = &g_lst[g_nlst];
+        copy_field(l->name, tok, sizeof(l->name));
+        char *opt = strchr(tok, ',');
+        l->proxy = 0;
+        if (opt) {
+            *opt++ = '\0';
+            if (strcmp(opt, "proxy") != 0) {
+                log_msg(LV_ERROR, "INIT", "%s: unknown option '%s'", l->name, opt);
+                return -1;
+            }
+            l->proxy = 1;
+        }
+        l->fd = listen_open(tok);
+        if (l->fd < 0) {
+            log_msg(LV_ERROR, "INIT", "%s: %s", l->name, strerror(errno));
+            return -1;
+        }
+        g_nlst++;
+        log_msg(LV_INFO, "INIT", "Listening on %s", l->name);
+    }
+    return g_nlst > 0 ? 0 : -1;
+}
+
+/* Read until buf holds at least want bytes (or the peer stops sending) */
+static int read_upto(int fd, char *buf, int total, int want) {
+    while (total < want && total < g_buf_sz - 1) {
+        int n = read(fd, buf + total, g_buf_sz - 1 - total);
+        if (n <= 0) break;
+        total += n;
+    }
+    return total;
+}
+
+/*
+ * Strip the PROXY header (v2 binary or v1 text) from the start of
+ * buf and put the original client address in peer. LOCAL/UNKNOWN
+ * (proxy health checks) keep the socket's own address. Returns the
+ * bytes left in buf, or -1 if the header is missing or malformed.
+ */
+static int proxy_strip(int fd, char *buf, int total, char *peer, int psz) {
+    const unsigned char *b = (const unsigned char *)buf;
+    int hl;
+
+    total = read_upto(fd, buf, total, 16);
+    if (total >= 16 && memcmp(buf, PROXY_V2_SIG, 12) == 0) {
+        hl = 16 + (b[14] << 8 | b[15]);
+        if ((b[12] >> 4) != 2 || hl > g_buf_sz - 1) return -1;
+        total = read_upto(fd, buf, total, hl);
+        if (total < hl) return -1;
+        if ((b[12] & 0x0F) == 1) {     /* PROXY command */
+            if ((b[13] >> 4) == 1 && hl >= 16 + 12)
+                inet_ntop(AF_INET, b + 16, peer, psz);
+            else if ((b[13] >> 4) == 2 && hl >= 16 + 36)
+                inet_ntop(AF_INET6, b + 16, peer, psz);
+        }
+    } else if (total >= 6 && memcmp(buf, "PROXY ", 6) == 0) {
+        char *eol;
+        while (!(eol = memmem(buf, total < 107 ? total : 107, "\r\n", 2))) {
+            int before = total;
+            if (total >= 107) return -1;
+            total = read_upto(fd, buf, total, total + 1);
+            if (total == before) return -1;
+        }
+        hl = (int)(eol + 2 - buf);
+        *eol = '\0';
+
+        char proto[8] = "", src[48] = "";
+        unsigned char addr[16];
+        sscanf(buf, "PROXY %7s %47s", proto, src);
+        if (strcmp(proto, "TCP4") == 0 && inet_pton(AF_INET, src, addr) == 1)
+            copy_field(peer, src, psz);
+        else if (strcmp(proto, "TCP6") == 0 && inet_pton(AF_INET6, src, addr) == 1)
+            copy_field(peer, src, psz);
+        else if (strcmp(proto, "UNKNOWN") != 0)
+            return -1;
+    } else {
+        return -1;
+    }
+
+    total -= hl;
+    memmove(buf, buf + hl, total);
+    return read_upto(fd, buf, total, 1);
+}
+
+/* Client address of an accepted socket, as text */
+static void peer_name(const struct sockaddr_storage *sa, char *out, int sz) {
+    if (sa->ss_family == AF_INET)
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)sa)->sin_addr, out, sz);
+    else if (sa->ss_family == AF_INET6)
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)sa)->sin6_addr, out, sz);
+    else
+        copy_field(out, "unix", sz);
 }
 
 /* ============================================================
  * HTTP REQUEST HANDLER
  * ============================================================ */
-static void handle_request(int fd) {
-    char buf[BUF_SZ] = {0};
+/* Returns 1 if fd was kept open (WebSocket upgrade), 0 to close it */
+static int handle_request(int fd, const Listener *l, char *peer, int psz) {
+    static char json[65536];
+    char *buf = g_reqbuf;
+    uint64_t t0 = g_access_log || g_trace ? now_us(CLOCK_MONOTONIC) : 0;
+    const char *issued = NULL;
+    int kept = 0;
+    g_resp_status = g_resp_bytes = 0;
 
     /* Read the request with a short timeout */
     struct timeval tv = {5, 0};
     setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
     int total = 0;
-    int n = read(fd, buf, BUF_SZ - 1);
-    if (n <= 0) return;
+    int n = read(fd, buf, g_buf_sz - 1);
+    if (n <= 0) return 0;
     total = n;
 
+    if (l->proxy) {
+        total = proxy_strip(fd, buf, total, peer, psz);
+        if (total <= 0) {
+            log_msg(LV_WARN, "PROXY", "bad or missing header on %s", l->name);
+            return 0;
+        }
+    }
+    buf[total] = '\0';
+
     /* For POST, ensure we read the full body */
     char *cl_hdr = strcasestr(buf, "Content-Length:");
     if (cl_hdr) {
@@ -640,8 +2234,8 @@ static void handle_request(int fd) {
         if (body_start) {
             body_start += 4;
             int body_read = total - (int)(body_start - buf);
-            while (body_read < cl && total < BUF_SZ - 1) {
-                n = read(fd, buf + total, BUF_SZ - 1 - total);
+            while (body_read < cl && total < g_buf_sz - 1) {
+                n = read(fd, buf + total, g_buf_sz - 1 - total);
                 if (n <= 0) break;
                 total += n;
                 body_read += n;
@@ -657,6 +2251,9 @@ static void handle_request(int fd) {
     /* Find body */
     char *body = strstr(buf, "\r\n\r\n");
     body = body ? body + 4 : "";
+    int body_len = *body ? total - (int)(body - buf) : 0;
+    char target[512];
+    memcpy(target, path, sizeof(target));
 
     /* Separate path and query string */
     char *qs = strchr(path, '?');
@@ -668,7 +2265,17 @@ static void handle_request(int fd) {
         if (strcmp(path, "/") == 0 || strcmp(path, "/index.html") == 0) {
             send_html(fd);
         } else if (strcmp(path, "/api/poll") == 0) {
-            handle_poll(fd, qs);
+            handle_poll(qs, json, sizeof(json));
+            send_json(fd, json);
+        } else if (strcmp(path, "/api/presence") == 0) {
+            handle_presence(qs, json, sizeof(json));
+            send_json(fd, json);
+        } else if (strcmp(path, "/api/state") == 0 && (g_trace || g_replay)) {
+            handle_state(json, sizeof(json));
+            send_json(fd, json);
+        } else if (strcmp(path, "/ws") == 0) {
+            kept = ws_handshake(fd, buf);
+            if (kept) g_resp_status = 101;
         } else if (strcmp(path, "/favicon.ico") == 0) {
             send_response(fd, 204, "text/plain", "", 0);
         } else {
@@ -676,11 +2283,18 @@ static void handle_request(int fd) {
         }
     } else if (strcmp(method, "POST") == 0) {
         if (strcmp(path, "/api/login") == 0) {
-            handle_login(fd, body);
+            Usr *nu = handle_login(body, json, sizeof(json));
+            if (nu) issued = nu->token;
+            send_json(fd, json);
         } else if (strcmp(path, "/api/send") == 0) {
-            handle_send(fd, body);
+            handle_send(body, json, sizeof(json));
+            send_json(fd, json);
         } else if (strcmp(path, "/api/cmd") == 0) {
-            handle_cmd(fd, body);
+            handle_cmd(body, json, sizeof(json));
+            send_json(fd, json);
+        } else if (strcmp(path, "/api/timeout") == 0 && g_replay) {
+            handle_timeout(body, json, sizeof(json));
+            send_json(fd, json);
         } else {
             send_404(fd);
         }
@@ -694,47 +2308,542 @@ static void handle_request(int fd) {
             "Access-Control-Allow-Headers: Content-Type\r\n"
             "Content-Length: 0\r\n\r\n");
         write(fd, hdr, hl);
+        g_resp_status = 204;
+    }
+
+    if (g_trace)
+        trace_request(t0, method, target, body, body_len, issued);
+    if (g_access_log) {
+        char req[sizeof(((LogRec *)0)->s2)];
+        snprintf(req, sizeof(req), "%s %s", method, path);
+        log_rec(LV_INFO, EV_ACCESS, peer, req, g_resp_bytes, g_resp_status,
+                (uint32_t)(now_us(CLOCK_MONOTONIC) - t0));
     }
+    return kept;
 }
 
 /* ============================================================
  * CLEANUP TIMED-OUT USERS
  * ============================================================ */
 static void cleanup_users(void) {
+    if (g_replay) return;              /* the trace says who timed out */
     time_t now = time(NULL);
     for (int i = 0; i < g_ucnt; i++) {
         if (g_usrs[i].active &&
-            (now - g_usrs[i].last_seen) > TIMEOUT_SEC) {
-            char sysmsg[128];
-            snprintf(sysmsg, sizeof(sysmsg),
-                "%s timed out", g_usrs[i].nick);
-            add_message("SYSTEM", g_usrs[i].room, sysmsg, 1, NULL);
-            g_usrs[i].active = 0;
-            printf("[TIMEOUT] %s\n", g_usrs[i].nick);
+            (now - g_usrs[i].last_seen) > TIMEOUT_SEC)
+            user_timeout(&g_usrs[i]);
+    }
+}
+
+/* ============================================================
+ * HOT RESTART (SIGUSR2)
+ * ============================================================
+ * The server forks a stand-in that keeps serving, then execs the
+ * new binary in place, so the PID (a container's PID 1) survives.
+ * The new image finishes its own init, sends "R" on the inherited
+ * socketpair, and the stand-in stops serving and hands over the
+ * listener and WebSocket fds (SCM_RIGHTS) plus a snapshot of the
+ * users, hot message window and counters. On "K" the stand-in
+ * exits; on any failure it simply keeps serving. Connections that
+ * arrive meanwhile wait in the listen backlog, none are refused.
+ * Listeners are inherited as they are; MININ_LISTEN changes need a
+ * full restart.
+ *
+ * Snapshot: next_id nseg arch_cnt pver
+ *           nlisten { proxy name\0 }
+ *           nusers { slot last_seen nick\0 room\0 token\0 }
+ *           nmsgs  { msg_pack record }
+ *           nws    { uidx last_io close_by token\0 inlen in[] mop mlen msg[]
+ *                    outlen out[] }
+ */
+#define HANDOFF_ENV "MININ_HANDOFF_FD"   /* "fd:stand-in pid" */
+#define CHECK_SEC   10                   /* new binary's --check run */
+#define SNAP_MAGIC  0x354E534DU        /* "MSN5" */
+
+typedef struct {
+    uint32_t magic;
+    int32_t  nlst;         /* fds: listeners first, then WebSockets, */
+    int32_t  nws;
+    int32_t  nhist;        /* then index.bin (1) with its flock */
+    int32_t  pid;          /* stand-in, for the new process to reap */
+    uint32_t snap_len;
+} HandoffHdr;
+
+typedef struct {
+    const unsigned char *p, *end;
+    int bad;
+} SnapRd;
+
+static volatile sig_atomic_t g_upgrade = 0;
+static int   g_handoff_fd = -1;    /* stand-in: waiting for "R" */
+static pid_t g_reap_pid = 0;       /* new image: stand-in to reap */
+static pid_t g_check_pid = 0;      /* new binary's --check run */
+static time_t g_check_by;
+static volatile sig_atomic_t g_fwd_sig = 0;
+static char  g_self[PATH_MAX];
+static char **g_argv;
+
+static void on_sigusr2(int sig) { (void)sig; g_upgrade = 1; }
+static void on_fwd(int sig) { if (sig != SIGCHLD) g_fwd_sig = sig; }
+
+static unsigned char *put_i32(unsigned char *p, int32_t v) {
+    memcpy(p, &v, 4);
+    return p + 4;
+}
+
+static unsigned char *put_i64(unsigned char *p, int64_t v) {
+    memcpy(p, &v, 8);
+    return p + 8;
+}
+
+static void rd_raw(SnapRd *r, void *dst, int n) {
+    if (r->bad || n < 0 || r->end - r->p < n) { r->bad = 1; return; }
+    memcpy(dst, r->p, n);
+    r->p += n;
+}
+
+static int32_t rd_i32(SnapRd *r) { int32_t v = 0; rd_raw(r, &v, 4); return v; }
+static int64_t rd_i64(SnapRd *r) { int64_t v = 0; rd_raw(r, &v, 8); return v; }
+
+static void rd_str(SnapRd *r, char *dst, int sz) {
+    int n = r->bad ? -1 : get_str(r->p, r->end, dst, sz);
+    if (n < 0) { r->bad = 1; dst[0] = '\0'; return; }
+    r->p += n;
+}
+
+static unsigned char *snap_build(uint32_t *len) {
+    size_t cap = 64
+        + (size_t)g_nlst * (4 + sizeof(g_lst[0].name))
+        + (size_t)g_ucnt * (16 + NK_SZ + RM_SZ + TK_SZ + 1)
+        + (size_t)g_mcnt * (13 + 2 * NK_SZ + RM_SZ + MSG_SZ)
+        + (size_t)g_wscnt * (44 + TK_SZ + 1 + WS_BUF_SZ + WS_MSG_SZ + WS_OUT_SZ);
+    unsigned char *buf = malloc(cap), *p = buf;
+    if (!buf) return NULL;
+
+    p = put_i32(p, g_next_id);
+    p = put_i32(p, g_nseg);
+    p = put_i32(p, g_arch_cnt);
+    p = put_i32(p, g_pver);
+
+    p = put_i32(p, g_nlst);
+    for (int i = 0; i < g_nlst; i++) {
+        p = put_i32(p, g_lst[i].proxy);
+        p += put_str(p, g_lst[i].name);
+    }
+
+    int nu = 0;
+    for (int i = 0; i < g_ucnt; i++) if (g_usrs[i].active) nu++;
+    p = put_i32(p, nu);
+    for (int i = 0; i < g_ucnt; i++) {
+        const Usr *u = &g_usrs[i];
+        if (!u->active) continue;
+        p = put_i32(p, i);
+        p = put_i64(p, u->last_seen);
+        p += put_str(p, u->nick);
+        p += put_str(p, u->room);
+        p += put_str(p, u->token);
+    }
+
+    p = put_i32(p, g_mcnt);
+    for (int i = 0; i < g_mcnt; i++)
+        p += msg_pack(&g_msgs[i], p);
+
+    int nw = 0;
+    for (int i = 0; i < g_wscnt; i++) if (g_ws[i].fd >= 0) nw++;
+    p = put_i32(p, nw);
+    for (int i = 0; i < g_wscnt; i++) {
+        const WsConn *c = &g_ws[i];
+        if (c->fd < 0) continue;
+        p = put_i32(p, c->uidx);
+        p = put_i64(p, c->last_io);
+        p = put_i64(p, c->close_by);
+        p += put_str(p, c->token);
+        p = put_i32(p, c->inlen);
+        memcpy(p, c->in, c->inlen); p += c->inlen;
+        p = put_i32(p, c->mop);
+        p = put_i32(p, c->mlen);
+        memcpy(p, c->msg, c->mlen); p += c->mlen;
+        p = put_i32(p, c->outlen);
+        memcpy(p, c->out, c->outlen); p += c->outlen;
+    }
+
+    *len = (uint32_t)(p - buf);
+    return buf;
+}
+
+/* New image: restore state from a snapshot; fds[] are listeners, then WebSockets */
+static int snap_restore(const unsigned char *buf, uint32_t len,
+                        const int *fds, int nlst, int nfds, int hist_fd) {
+    SnapRd r = { buf, buf + len, 0 };
+
+    g_next_id = rd_i32(&r);
+    int nseg = rd_i32(&r), arch = rd_i32(&r), pver = rd_i32(&r);
+
+    if (rd_i32(&r) != nlst) r.bad = 1;
+    for (int k = 0; k < nlst && !r.bad; k++) {
+        Listener *l = &g_lst[k];
+        l->fd = fds[k];
+        l->proxy = rd_i32(&r);
+        rd_str(&r, l->name, sizeof(l->name));
+        g_nlst = k + 1;
+    }
+    fds += nlst;
+
+    int nu = rd_i32(&r);
+    for (int k = 0; k < nu && !r.bad; k++) {
+        int slot = rd_i32(&r);
+        if (slot < 0 || slot >= MAX_USR) { r.bad = 1; break; }
+        Usr *u = &g_usrs[slot];
+        char room[RM_SZ];
+        memset(u, 0, sizeof(Usr));
+        u->last_seen = (time_t)rd_i64(&r);
+        rd_str(&r, u->nick, NK_SZ);
+        rd_str(&r, room, RM_SZ);
+        rd_str(&r, u->token, TK_SZ + 1);
+        u->active = 1;
+        room_join(u, room);
+        if (slot >= g_ucnt) g_ucnt = slot + 1;
+    }
+    /* Old presence versions stay valid, but their deltas are gone */
+    g_pver = g_pmin = pver;
+
+    int nm = rd_i32(&r);
+    if (nm < 0 || nm > MAX_MSG) r.bad = 1;
+    for (int k = 0; k < nm && !r.bad; k++) {
+        int n = msg_unpack(&g_msgs[k], r.p, r.end);
+        if (n < 0) { r.bad = 1; break; }
+        r.p += n;
+        g_mcnt = k + 1;
+    }
+
+    int nw = rd_i32(&r);
+    if (nw != nfds) r.bad = 1;
+    for (int k = 0; k < nw && !r.bad; k++) {
+        WsConn *c = &g_ws[k];
+        c->fd = fds[k];
+        c->uidx = rd_i32(&r);
+        c->last_io = (time_t)rd_i64(&r);
+        c->close_by = (time_t)rd_i64(&r);
+        rd_str(&r, c->token, TK_SZ + 1);
+        c->inlen = rd_i32(&r);
+        if (c->inlen < 0 || c->inlen > WS_BUF_SZ) { r.bad = 1; break; }
+        rd_raw(&r, c->in, c->inlen);
+        c->mop = rd_i32(&r);
+        c->mlen = rd_i32(&r);
+        if (c->mlen < 0 || c->mlen >= WS_MSG_SZ) { r.bad = 1; break; }
+        rd_raw(&r, c->msg, c->mlen);
+        c->outlen = rd_i32(&r);
+        if (c->outlen < 0 || c->outlen > WS_OUT_SZ) { r.bad = 1; break; }
+        rd_raw(&r, c->out, c->outlen);
+        if (c->uidx < -1 || c->uidx >= MAX_USR) c->uidx = -1;
+        g_wscnt = k + 1;
+    }
+
+    if (r.bad) return -1;
+    hist_resume(hist_fd, nseg, arch);
+    return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+/* Stand-in: the new image is ready; hand everything over and exit */
+static void handoff_send(void) {
+    char c = 0;
+    if (read(g_handoff_fd, &c, 1) != 1 || c != 'R') {
+        log_msg(LV_WARN, "UPGRADE", "new binary did not start, keep serving");
+        goto abort;
+    }
+    trace_flush();                     /* new image appends after us */
+
+    int fds[MAX_LISTEN + MAX_WS + 1], nfds = 0;
+    for (int i = 0; i < g_nlst; i++)
+        fds[nfds++] = g_lst[i].fd;
+    for (int i = 0; i < g_wscnt; i++)
+        if (g_ws[i].fd >= 0) fds[nfds++] = g_ws[i].fd;
+    int nws = nfds - g_nlst, nhist = g_idx_fd >= 0;
+    if (nhist) fds[nfds++] = g_idx_fd;
+
+    uint32_t len = 0;
+    unsigned char *snap = snap_build(&len);
+    if (!snap) goto abort;
+
+    HandoffHdr h = { SNAP_MAGIC, g_nlst, nws, nhist, (int32_t)getpid(), len };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * (MAX_LISTEN + MAX_WS + 1))];
+        struct cmsghdr align;
+    } ctl;
+    struct iovec iov = { &h, sizeof(h) };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    memset(&ctl, 0, sizeof(ctl));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+
+    int sent = sendmsg(g_handoff_fd, &mh, 0) == (ssize_t)sizeof(h) &&
+               write_all(g_handoff_fd, snap, len) == 0;
+    free(snap);
+
+    struct timeval tv = {5, 0};
+    setsockopt(g_handoff_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (sent && read(g_handoff_fd, &c, 1) == 1 && c == 'K') {
+        log_msg(LV_INFO, "UPGRADE", "handed over %d users, %d msgs, %d sockets",
+                g_online, g_mcnt, g_nlst + nws);
+        log_shutdown();
+        _exit(0);
+    }
+    log_msg(LV_WARN, "UPGRADE", "handoff failed, keep serving");
+
+abort:
+    close(g_handoff_fd);
+    g_handoff_fd = -1;
+}
+
+/* New image: pull listeners, sockets and state from the stand-in */
+static int handoff_recv(int hfd) {
+    HandoffHdr h;
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * (MAX_LISTEN + MAX_WS + 1))];
+        struct cmsghdr align;
+    } ctl;
+    struct iovec iov = { &h, sizeof(h) };
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+
+    if (write(hfd, "R", 1) != 1) return -1;
+    if (recvmsg(hfd, &mh, MSG_WAITALL | MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(h))
+        return -1;
+
+    if (h.pid > 0) g_reap_pid = h.pid;
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    if (h.magic != SNAP_MAGIC || !cm || cm->cmsg_type != SCM_RIGHTS ||
+        h.nlst < 1 || h.nlst > MAX_LISTEN || h.nws < 0 || h.nws > MAX_WS ||
+        (h.nhist != 0 && h.nhist != 1) ||
+        cm->cmsg_len != CMSG_LEN(sizeof(int) * (h.nlst + h.nws + h.nhist)))
+        return -1;
+    int fds[MAX_LISTEN + MAX_WS + 1], nfds = h.nlst + h.nws + h.nhist;
+    memcpy(fds, CMSG_DATA(cm), sizeof(int) * nfds);
+
+    unsigned char *snap = malloc(h.snap_len ? h.snap_len : 1);
+    size_t got = 0;
+    while (snap && got < h.snap_len) {
+        ssize_t n = read(hfd, snap + got, h.snap_len - got);
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    int ok = snap && got == h.snap_len &&
+             snap_restore(snap, h.snap_len, fds, h.nlst, h.nws,
+                          h.nhist ? fds[nfds - 1] : -1) == 0 &&
+             write(hfd, "K", 1) == 1;
+    free(snap);
+    if (!ok) {
+        /* Our copies would keep connections the stand-in still serves */
+        for (int i = 0; i < nfds; i++) close(fds[i]);
+        return -1;
+    }
+
+    close(hfd);
+    log_msg(LV_INFO, "UPGRADE", "took over %d users, %d msgs, %d sockets",
+            g_online, g_mcnt, h.nlst + h.nws);
+    return 0;
+}
+
+/*
+ * Upgrade failed after the fork: the stand-in keeps serving, but this
+ * PID (a container's PID 1) must outlive it, or the kernel takes the
+ * whole PID namespace, stand-in included, down with us. USR2, TERM and
+ * INT sent to this PID go on to the stand-in, so a later upgrade or
+ * `docker stop` still reaches the process that actually serves.
+ */
+static void standin_wait(pid_t pid) {
+    static const int sigs[] = {SIGUSR2, SIGTERM, SIGINT, SIGCHLD};
+    struct sigaction sa;
+    sigset_t block, old;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_fwd;
+    sigemptyset(&block);
+    for (int i = 0; i < 4; i++) sigaddset(&block, sigs[i]);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    for (int i = 0; i < 4; i++) sigaction(sigs[i], &sa, NULL);
+
+    int st = 0;
+    for (;;) {
+        pid_t w = waitpid(pid, &st, WNOHANG);
+        if (w == pid || (w < 0 && errno != EINTR)) break;
+        if (g_fwd_sig) {
+            if (pid > 0) kill(pid, g_fwd_sig);
+            g_fwd_sig = 0;
+            continue;
         }
+        sigsuspend(&old);              /* no signal slips in unseen */
+    }
+    _exit(WIFEXITED(st) ? WEXITSTATUS(st) : 1);
+}
+
+/*
+ * SIGUSR2: before anything is handed over, run the new binary with
+ * --check in a child. A binary that can't load its libraries or dies
+ * during init fails there, not after it has replaced this PID.
+ */
+static void upgrade_check(void) {
+    g_upgrade = 0;
+    if (g_handoff_fd >= 0 || g_check_pid > 0) return;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        log_msg(LV_ERROR, "UPGRADE", "fork: %s", strerror(errno));
+        return;
+    }
+    if (pid == 0) {
+        execl(g_self, g_self, "--check", (char *)NULL);
+        _exit(127);
     }
+    log_msg(LV_INFO, "UPGRADE", "checking %s", g_self);
+    g_check_pid = pid;
+    g_check_by = time(NULL) + CHECK_SEC;
+}
+
+static void upgrade_start(void);
+
+/* Main loop: collect the --check result, then upgrade or give up */
+static void upgrade_poll(time_t now) {
+    int st = 0;
+    pid_t w = waitpid(g_check_pid, &st, WNOHANG);
+    if (w == 0) {
+        if (now < g_check_by) return;
+        kill(g_check_pid, SIGKILL);
+        waitpid(g_check_pid, NULL, 0);
+        log_msg(LV_ERROR, "UPGRADE", "check timed out, upgrade cancelled");
+    } else if (w == g_check_pid && WIFEXITED(st) && WEXITSTATUS(st) == 0) {
+        g_check_pid = 0;
+        upgrade_start();
+        return;
+    } else if (w == g_check_pid && WIFSIGNALED(st)) {
+        log_msg(LV_ERROR, "UPGRADE", "check killed by signal %d, upgrade cancelled",
+                WTERMSIG(st));
+    } else {
+        log_msg(LV_ERROR, "UPGRADE", "check exited with %d, upgrade cancelled",
+                w == g_check_pid && WIFEXITED(st) ? WEXITSTATUS(st) : -1);
+    }
+    g_check_pid = 0;
+}
+
+/* Check passed: fork a stand-in, then exec the new binary under this PID */
+static void upgrade_start(void) {
+    if (g_handoff_fd >= 0) return;
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        log_msg(LV_ERROR, "UPGRADE", "socketpair: %s", strerror(errno));
+        return;
+    }
+    log_msg(LV_INFO, "UPGRADE", "exec %s", g_self);
+    log_shutdown();                    /* fork copies only this thread */
+    trace_flush();                     /* don't let both copies flush it */
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        log_start();
+        log_msg(LV_ERROR, "UPGRADE", "fork: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(sv[1]);
+        log_start();
+        g_handoff_fd = sv[0];
+        return;
+    }
+
+    /* Everything else is close-on-exec; only the handoff end survives */
+    close(sv[0]);
+    fcntl(sv[1], F_SETFD, 0);
+    char fdstr[32];
+    snprintf(fdstr, sizeof(fdstr), "%d:%d", sv[1], (int)pid);
+    setenv(HANDOFF_ENV, fdstr, 1);
+    execv(g_self, g_argv);
+
+    /* exec failed: the stand-in serves on; stay alive as its parent */
+    perror("execv");
+    close(sv[1]);
+    standin_wait(pid);
 }
 
 /* ============================================================
  * MAIN
  * ============================================================ */
-int main(void) {
+static volatile sig_atomic_t g_stop = 0;
+
+static void on_stop(int sig) { (void)sig; g_stop = 1; }
+
+int main(int argc, char **argv) {
+    int check = argc > 1 && strcmp(argv[1], "--check") == 0;
     signal(SIGPIPE, SIG_IGN);
     signal(SIGCHLD, SIG_DFL);
+    signal(SIGUSR2, on_sigusr2);
+    signal(SIGTERM, on_stop);          /* PID 1 gets no default action */
+    signal(SIGINT, on_stop);
     srand((unsigned)time(NULL) ^ (unsigned)getpid());
 
+    /* Remember how to re-exec ourselves for hot restart */
+    g_argv = argv;
+    if (!realpath(argv[0], g_self)) {
+        ssize_t n = readlink("/proc/self/exe", g_self, sizeof(g_self) - 1);
+        g_self[n > 0 ? n : 0] = '\0';
+    }
+    const char *handoff = getenv(HANDOFF_ENV);
+    int handoff_fd = -1, standin = 0;
+    if (handoff && sscanf(handoff, "%d:%d", &handoff_fd, &standin) < 1)
+        handoff_fd = -1;
+    if (standin > 0) g_reap_pid = standin;
+    unsetenv(HANDOFF_ENV);
+    /* Cleared for the exec only; keep it out of COBOL children */
+    if (handoff_fd >= 0) fcntl(handoff_fd, F_SETFD, FD_CLOEXEC);
+
     printf("╔═══════════════════════════════════════╗\n");
     printf("║     MININ-CHAT SERVER v1.0            ║\n");
     printf("║     COBOL + FORTRAN + C               ║\n");
-    printf("║     Port: %d                         ║\n", PORT);
     printf("╚═══════════════════════════════════════╝\n");
+    fflush(stdout);
+
+    log_init();
+
+    hist_config();
+    g_buf_sz = env_int("MININ_BUF_SZ", BUF_SZ, 1024, 1 << 24);
+    g_reqbuf = malloc(g_buf_sz);
+    if (!g_reqbuf) { perror("malloc"); return 1; }
 
     load_html();
+    pres_init();
+    if (!check) trace_init();
+    for (int i = 0; i < MAX_WS; i++) g_ws[i].fd = -1;
 
     /* Test COBOL */
     char test_out[256] = {0};
     cobol_call("MOTD", test_out, sizeof(test_out));
-    printf("[INIT] COBOL test: %s\n", test_out[0] ? "OK" : "UNAVAILABLE");
+    log_msg(LV_INFO, "INIT", "COBOL test: %s", test_out[0] ? "OK" : "UNAVAILABLE");
 
     /* Test Fortran encryption */
     {
@@ -744,63 +2853,106 @@ int main(void) {
         minin_encrypt(test, encrypted, &len, &key);
         minin_decrypt(encrypted, decrypted, &len, &key);
         decrypted[len] = '\0';
-        printf("[INIT] Fortran crypto test: %s\n",
+        log_msg(LV_INFO, "INIT", "Fortran crypto test: %s",
             strcmp(test, decrypted) == 0 ? "OK" : "FAIL");
     }
 
-    /* Create server socket */
-    int srv = socket(AF_INET, SOCK_STREAM, 0);
-    if (srv < 0) { perror("socket"); return 1; }
-
-    int opt = 1;
-    setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(PORT);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    if (bind(srv, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        return 1;
-    }
-    if (listen(srv, BACKLOG) < 0) {
-        perror("listen");
-        return 1;
+    /* Hot restart probe: everything up to here loaded and ran */
+    if (check) {
+        log_msg(LV_INFO, "INIT", "Check OK.");
+        log_shutdown();
+        return 0;
     }
 
-    printf("[INIT] Listening on 0.0.0.0:%d\n", PORT);
-    printf("[INIT] Ready for connections.\n\n");
+    if (handoff_fd >= 0) {
+        /* Hot restart: listeners, sockets and state come from the stand-in */
+        if (handoff_recv(handoff_fd) < 0) {
+            log_msg(LV_ERROR, "UPGRADE", "handoff failed, old process keeps serving");
+            log_shutdown();
+            close(handoff_fd);             /* stand-in sees EOF, serves on */
+            standin_wait(g_reap_pid > 0 ? g_reap_pid : -1);
+        }
+    } else {
+        if (hist_init() < 0 || listen_init() < 0) {
+            log_shutdown();
+            return 1;
+        }
+    }
+    log_msg(LV_INFO, "INIT", "Ready for connections.");
 
     time_t last_clean = time(NULL);
 
-    /* Main accept loop with select for periodic cleanup */
-    while (1) {
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(srv, &fds);
-        struct timeval tv = {15, 0};
+    /* Main loop: select over listener + WebSocket clients */
+    while (!g_stop) {
+        if (g_upgrade) upgrade_check();
 
-        int r = select(srv + 1, &fds, NULL, NULL, &tv);
-        if (r > 0 && FD_ISSET(srv, &fds)) {
-            struct sockaddr_in cli_addr;
+        fd_set fds, wfds;
+        FD_ZERO(&fds);
+        FD_ZERO(&wfds);
+        int maxfd = -1;
+        for (int i = 0; i < g_nlst; i++) {
+            FD_SET(g_lst[i].fd, &fds);
+            if (g_lst[i].fd > maxfd) maxfd = g_lst[i].fd;
+        }
+        if (g_handoff_fd >= 0) {
+            FD_SET(g_handoff_fd, &fds);
+            if (g_handoff_fd > maxfd) maxfd = g_handoff_fd;
+        }
+        int closing = 0;
+        for (int i = 0; i < g_wscnt; i++) {
+            if (g_ws[i].fd < 0) continue;
+            FD_SET(g_ws[i].fd, &fds);
+            if (g_ws[i].outlen) FD_SET(g_ws[i].fd, &wfds);
+            if (g_ws[i].fd > maxfd) maxfd = g_ws[i].fd;
+            if (g_ws[i].close_by) closing = 1;
+        }
+        struct timeval tv = {closing ? 1 : 15, 0};
+        if (g_check_pid > 0) tv = (struct timeval){0, 100000};
+
+        int r = select(maxfd + 1, &fds, &wfds, NULL, &tv);
+        if (r == 0) trace_flush();     /* idle: don't sit on buffered records */
+        if (r > 0) {
+            for (int i = 0; i < g_wscnt; i++) {
+                WsConn *c = &g_ws[i];
+                if (c->fd >= 0 && FD_ISSET(c->fd, &fds))
+                    ws_read(c);
+                if (c->fd >= 0 && c->outlen && FD_ISSET(c->fd, &wfds))
+                    ws_flush(c);
+            }
+        }
+        for (int i = 0; r > 0 && i < g_nlst; i++) {
+            if (!FD_ISSET(g_lst[i].fd, &fds)) continue;
+            struct sockaddr_storage cli_addr;
             socklen_t cli_len = sizeof(cli_addr);
-            int cli = accept(srv, (struct sockaddr *)&cli_addr, &cli_len);
-            if (cli >= 0) {
-                handle_request(cli);
+            int cli = accept4(g_lst[i].fd, (struct sockaddr *)&cli_addr,
+                              &cli_len, SOCK_CLOEXEC);
+            if (cli < 0) continue;
+            char peer[INET6_ADDRSTRLEN] = "";
+            peer_name(&cli_addr, peer, sizeof(peer));
+            if (!handle_request(cli, &g_lst[i], peer, sizeof(peer)))
                 close(cli);
-            }
         }
+        if (r > 0 && g_handoff_fd >= 0 && FD_ISSET(g_handoff_fd, &fds))
+            handoff_send();
 
-        /* Periodic cleanup every 30 seconds */
         time_t now = time(NULL);
+        if (closing) ws_expire(now);
+        if (g_check_pid > 0) upgrade_poll(now);
+
+        /* Periodic cleanup every 30 seconds */
         if (now - last_clean > 30) {
             cleanup_users();
+            ws_keepalive();
+            trace_flush();
+            if (g_reap_pid > 0 && waitpid(g_reap_pid, NULL, WNOHANG) != 0)
+                g_reap_pid = 0;
             last_clean = now;
         }
     }
 
-    close(srv);
+    log_msg(LV_INFO, "INIT", "Shutting down.");
+    for (int i = 0; i < g_nlst; i++) close(g_lst[i].fd);
+    trace_flush();
+    log_shutdown();
     return 0;
 }
@@ -0,0 +1,37 @@
+/*
+ * MININ-CHAT REQUEST TRACE FORMAT
+ * ===============================
+ * Shared by server.c (capture, MININ_TRACE=file) and replay.c.
+ *
+ * File:   TraceFileHdr, then records until EOF.
+ * Record: TraceRecHdr, method[method_len], target[target_len]
+ *         (path + query), body[body_len].
+ *
+ * t_us is CLOCK_MONOTONIC, so a trace appended to by several
+ * processes (hot restart) stays on one timeline. token holds the
+ * token /api/login issued, letting replay map it to the new one.
+ * Native byte order: traces are replayed on the same architecture.
+ */
+#ifndef MININ_TRACE_H
+#define MININ_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC   0x5254434DU      /* "MCTR" */
+#define TRACE_VERSION 1
+#define TRACE_TK_SZ   16
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} TraceFileHdr;
+
+typedef struct {
+    uint64_t t_us;
+    uint16_t method_len;
+    uint16_t target_len;
+    uint32_t body_len;
+    char     token[TRACE_TK_SZ];
+} TraceRecHdr;
+
+#endif